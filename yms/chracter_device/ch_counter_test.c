@@ -0,0 +1,43 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ch_device.h"
+int main()
+{
+    int fd;
+    volatile __u64 *counters;
+    struct ch_counter_op op = {0};
+    //打开"/dev/ch_device"
+    fd = open("/dev/ch_device", O_RDWR);
+    if (fd == -1)
+    {
+        printf("Device open failure\n");
+        return 1;
+    }
+    //只读映射计数器页，之后读取计数器不需要系统调用
+    counters = mmap(NULL, CH_COUNTER_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (counters == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+    printf("counter[1] before: %llu\n", (unsigned long long)counters[1]);
+    //原子加
+    op.index = 1;
+    op.value = 5;
+    ioctl(fd, CH_COUNTER_ADD, &op);
+    printf("add 5 -> %lld, mapped value %llu\n", (long long)op.result, (unsigned long long)counters[1]);
+    //CAS：期望旧值为 result，写入 100
+    op.expected = op.result;
+    op.value = 100;
+    ioctl(fd, CH_COUNTER_CAS, &op);
+    printf("cas old %lld, mapped value %llu\n", (long long)op.result, (unsigned long long)counters[1]);
+    munmap((void *)counters, CH_COUNTER_PAGE_SIZE);
+    close(fd);
+    return 0;
+}
@@ -4,25 +4,68 @@
 #include <asm/uaccess.h>
 #include <linux/init.h>
 #include <linux/uaccess.h> 
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include "ch_device.h"
 //#inculde <unistd.h>
 MODULE_LICENSE("GPL");
 #define MAJOR_NUM 290
 static ssize_t ch_device_read(struct file *, char *, size_t, loff_t*);
 static ssize_t ch_device_write(struct file *, const char *, size_t, loff_t*);
+static long ch_device_ioctl(struct file *, unsigned int, unsigned long);
+static int ch_device_mmap(struct file *, struct vm_area_struct *);
+static loff_t ch_device_llseek(struct file *, loff_t, int);
 struct file_operations ch_device_fops ={
+    owner: THIS_MODULE,     //还有打开的文件或映射时不能卸载，计数器页不会被提前释放
+    llseek: ch_device_llseek,
     read: ch_device_read,
-    write: ch_device_write
+    write: ch_device_write,
+    unlocked_ioctl: ch_device_ioctl,
+    mmap: ch_device_mmap
 };
-static int global_var = 0;
+//计数器页：用户态 mmap 只读后用普通的 load 读取，修改通过 ioctl 原子完成。
+//计数器只能通过 mmap 和 ioctl 访问，与 read/write 访问的寄存器文件相互独立
+static atomic64_t *counters;
+//寄存器文件：每个槽位一个 seqlock，写者之间互斥，读者不加锁、不阻塞写者，
+//读到一半被写者打断时重读，因此不会读到撕裂的值
+struct ch_slot
+{
+    seqlock_t lock;
+    char data[CH_SLOT_SIZE];
+};
+static struct ch_slot *slots;
+#define CH_STORE_SIZE (CH_SLOT_NUM * CH_SLOT_SIZE)
 //模块初始化函数：该函数用来完成对所控制设备的初始化工作，
 //并调用register_chrdev() 函数注册字符设备。
 static int init_mymodule(void)
 {
     int ret;
+    int i;
+    //计数器区占一个物理页的开头，64K 页的内核上页的其余部分保持为 0
+    BUILD_BUG_ON(CH_COUNTER_PAGE_SIZE > PAGE_SIZE);
+    counters = (atomic64_t *)get_zeroed_page(GFP_KERNEL);
+    if (!counters)
+    {
+        return -ENOMEM;
+    }
+    slots = kcalloc(CH_SLOT_NUM, sizeof(struct ch_slot), GFP_KERNEL);
+    if (!slots)
+    {
+        free_page((unsigned long)counters);
+        return -ENOMEM;
+    }
+    for (i = 0; i < CH_SLOT_NUM; i++)
+    {
+        seqlock_init(&slots[i].lock);
+    }
     ret = register_chrdev(MAJOR_NUM, "ch_device", &ch_device_fops);
     if (ret)
     {
         printk("ch_device register failure");
+        kfree(slots);
+        free_page((unsigned long)counters);
     }
     else
     {
@@ -34,22 +77,191 @@ static int init_mymodule(void)
 static void cleanup_mymodule(void)//模块卸载函数
 {
     unregister_chrdev(MAJOR_NUM, "ch_device");
+    kfree(slots);
+    free_page((unsigned long)counters);
+}
+//读出槽位 [in, in + n) 的一致快照
+static void slot_load(struct ch_slot *slot, char *dst, size_t in, size_t n)
+{
+    unsigned int seq;
+    do
+    {
+        seq = read_seqbegin(&slot->lock);
+        memcpy(dst, slot->data + in, n);
+    } while (read_seqretry(&slot->lock, seq));
+}
+static void slot_store(struct ch_slot *slot, const char *src, size_t in, size_t n)
+{
+    write_seqlock(&slot->lock);
+    memcpy(slot->data + in, src, n);
+    write_sequnlock(&slot->lock);
 }
+static loff_t ch_device_llseek(struct file *filp, loff_t off, int whence)
+{
+    return fixed_size_llseek(filp, off, whence, CH_STORE_SIZE);
+}
+//从 *off 开始读 len 字节，可跨越多个槽位，每个槽位内部保证一致。
+//与最初的单个整数接口不兼容：read/write 会推进文件偏移，同一个 fd 先读后写时
+//写入的是下一段位置，要访问固定位置请用 pread/pwrite 或先 lseek
 static ssize_t ch_device_read(struct file *filp, char *buf, size_t len, loff_t *off)
 {
-    if(copy_to_user(buf, &global_var, sizeof(int)))
+    char tmp[CH_SLOT_SIZE];
+    size_t done = 0;
+    loff_t pos = *off;
+    if (pos < 0)
     {
-        return -EFAULT;
+        return -EINVAL;
+    }
+    if (pos >= CH_STORE_SIZE)
+    {
+        return 0;
+    }
+    len = min_t(size_t, len, CH_STORE_SIZE - pos);
+    while (done < len)
+    {
+        size_t in = (pos + done) % CH_SLOT_SIZE;
+        size_t n = min_t(size_t, len - done, CH_SLOT_SIZE - in);
+        slot_load(&slots[(pos + done) / CH_SLOT_SIZE], tmp, in, n);
+        if (copy_to_user(buf + done, tmp, n))
+        {
+            //已经复制的部分照常推进偏移
+            if (!done)
+            {
+                return -EFAULT;
+            }
+            break;
+        }
+        done += n;
     }
-    return sizeof(int);
+    *off = pos + done;
+    return done;
 }
 static ssize_t ch_device_write(struct file *filp, const char *buf, size_t len, loff_t *off)
 {
-    if (copy_from_user(&global_var, buf, sizeof(int)))
+    char tmp[CH_SLOT_SIZE];
+    size_t done = 0;
+    loff_t pos = *off;
+    if (pos < 0)
+    {
+        return -EINVAL;
+    }
+    if (pos >= CH_STORE_SIZE)
+    {
+        return -ENOSPC;
+    }
+    len = min_t(size_t, len, CH_STORE_SIZE - pos);
+    while (done < len)
+    {
+        size_t in = (pos + done) % CH_SLOT_SIZE;
+        size_t n = min_t(size_t, len - done, CH_SLOT_SIZE - in);
+        //先拷贝到内核缓冲区，持锁期间不访问用户内存
+        if (copy_from_user(tmp, buf + done, n))
+        {
+            //已经复制的部分照常推进偏移
+            if (!done)
+            {
+                return -EFAULT;
+            }
+            break;
+        }
+        slot_store(&slots[(pos + done) / CH_SLOT_SIZE], tmp, in, n);
+        done += n;
+    }
+    *off = pos + done;
+    return done;
+}
+//一次 ioctl 读写多个槽位，每个槽位单独保证一致
+static long ch_slot_batch(struct ch_slot_batch __user *ubatch, int write)
+{
+    struct ch_slot_batch batch;
+    struct ch_slot_io io;
+    struct ch_slot_io __user *uios;
+    char tmp[CH_SLOT_SIZE];
+    __u32 i;
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+    {
+        return -EFAULT;
+    }
+    if (batch.count > CH_BATCH_MAX)
+    {
+        return -EINVAL;
+    }
+    uios = (struct ch_slot_io __user *)(unsigned long)batch.ios;
+    for (i = 0; i < batch.count; i++)
+    {
+        if (copy_from_user(&io, &uios[i], sizeof(io)))
+        {
+            return -EFAULT;
+        }
+        if (io.slot >= CH_SLOT_NUM || io.len > CH_SLOT_SIZE)
+        {
+            return -EINVAL;
+        }
+        if (write)
+        {
+            if (copy_from_user(tmp, (void __user *)(unsigned long)io.buf, io.len))
+            {
+                return -EFAULT;
+            }
+            slot_store(&slots[io.slot], tmp, 0, io.len);
+        }
+        else
+        {
+            slot_load(&slots[io.slot], tmp, 0, io.len);
+            if (copy_to_user((void __user *)(unsigned long)io.buf, tmp, io.len))
+            {
+                return -EFAULT;
+            }
+        }
+    }
+    return batch.count;
+}
+static long ch_device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct ch_counter_op op;
+    if (cmd == CH_SLOT_BATCH_READ || cmd == CH_SLOT_BATCH_WRITE)
+    {
+        return ch_slot_batch((struct ch_slot_batch __user *)arg, cmd == CH_SLOT_BATCH_WRITE);
+    }
+    if (copy_from_user(&op, (void __user *)arg, sizeof(op)))
     {
         return -EFAULT;
     }
-    return sizeof(int);
+    if (op.index >= CH_COUNTER_NUM)
+    {
+        return -EINVAL;
+    }
+    switch (cmd)
+    {
+    case CH_COUNTER_ADD:
+        op.result = atomic64_add_return(op.value, &counters[op.index]);
+        break;
+    case CH_COUNTER_CAS:
+        op.result = atomic64_cmpxchg(&counters[op.index], op.expected, op.value);
+        break;
+    default:
+        return -ENOTTY;
+    }
+    if (copy_to_user((void __user *)arg, &op, sizeof(op)))
+    {
+        return -EFAULT;
+    }
+    return 0;
+}
+//只允许只读映射整页，用户态不能绕过 ioctl 直接修改计数器
+static int ch_device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+    {
+        return -EINVAL;
+    }
+    if (vma->vm_flags & VM_WRITE)
+    {
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    return remap_pfn_range(vma, vma->vm_start, virt_to_phys(counters) >> PAGE_SHIFT,
+                           PAGE_SIZE, vma->vm_page_prot);
 }
 module_init(init_mymodule);
 module_exit(cleanup_mymodule);
\ No newline at end of file
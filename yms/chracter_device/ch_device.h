@@ -0,0 +1,49 @@
+#ifndef CH_DEVICE_H
+#define CH_DEVICE_H
+
+// ch_device 模块与用户态程序共用的接口定义
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// 计数器页：一页共享内存，开头 CH_COUNTER_PAGE_SIZE 字节按 64 位计数器划分，
+// 用户态 mmap 只读后直接读取。映射长度按 CH_COUNTER_PAGE_SIZE 给出即可，内核会补齐到系统页大小
+#define CH_COUNTER_PAGE_SIZE 4096
+#define CH_COUNTER_NUM (CH_COUNTER_PAGE_SIZE / sizeof(__u64))
+
+struct ch_counter_op
+{
+    __u32 index;        // 计数器下标
+    __u32 pad;
+    __s64 value;        // ADD：增量；CAS：期望写入的新值
+    __s64 expected;     // CAS：期望的旧值
+    __s64 result;       // 返回：ADD 后的新值；CAS 前的实际旧值
+};
+
+// 寄存器文件：CH_SLOT_NUM 个定长槽位，按文件偏移 pread/pwrite 访问，
+// 偏移 off 对应第 off / CH_SLOT_SIZE 个槽位。read/write 与普通文件一样推进偏移，
+// 不再像最初的接口那样总是读写同一个整数；最初的整数对应槽位 0 的前 4 个字节，与计数器页无关
+#define CH_SLOT_SIZE 64
+#define CH_SLOT_NUM 256
+#define CH_BATCH_MAX 64
+
+struct ch_slot_io
+{
+    __u32 slot;         // 槽位下标
+    __u32 len;          // 读写长度，不超过 CH_SLOT_SIZE，从槽位开头算起
+    __u64 buf;          // 用户态缓冲区地址
+};
+
+struct ch_slot_batch
+{
+    __u64 ios;          // struct ch_slot_io 数组的地址
+    __u32 count;        // 数组长度，不超过 CH_BATCH_MAX
+    __u32 pad;
+};
+
+#define CH_IOC_MAGIC 'k'
+#define CH_COUNTER_ADD _IOWR(CH_IOC_MAGIC, 1, struct ch_counter_op)
+#define CH_COUNTER_CAS _IOWR(CH_IOC_MAGIC, 2, struct ch_counter_op)
+#define CH_SLOT_BATCH_READ _IOW(CH_IOC_MAGIC, 3, struct ch_slot_batch)
+#define CH_SLOT_BATCH_WRITE _IOW(CH_IOC_MAGIC, 4, struct ch_slot_batch)
+
+#endif
@@ -3,23 +3,48 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include "ch_device.h"
 int main()
 {
-    int fd, num;
+    int fd, num, slot;
+    int nums[4];
+    struct ch_slot_io ios[4];
+    struct ch_slot_batch batch;
     //打开"/dev/ch_device"
     fd = open("/dev/ch_device", O_RDWR, S_IRUSR | S_IWUSR);
     if (fd != -1 )
     {
+        //选择槽位，偏移为 slot * CH_SLOT_SIZE
+        printf("Please input the slot (0-%d)\n", CH_SLOT_NUM - 1);
+        scanf("%d", &slot);
+        if (slot < 0 || slot >= CH_SLOT_NUM)
+        {
+            slot = 0;
+        }
         //初次读 ch_device
-        read(fd, &num, sizeof(int));
-        printf("The ch_device is %d\n", num);
+        pread(fd, &num, sizeof(int), slot * CH_SLOT_SIZE);
+        printf("The ch_device slot %d is %d\n", slot, num);
         //写 ch_device
         printf("Please input the num written to ch_device\n");
         scanf("%d", &num);
-        write(fd, &num, sizeof(int));
+        pwrite(fd, &num, sizeof(int), slot * CH_SLOT_SIZE);
         //再次读 ch_device
-        read(fd, &num, sizeof(int));
-        printf("The ch_device is %d\n", num);
+        pread(fd, &num, sizeof(int), slot * CH_SLOT_SIZE);
+        printf("The ch_device slot %d is %d\n", slot, num);
+        //一次 ioctl 读出前 4 个槽位
+        for (int i = 0; i < 4; i++)
+        {
+            ios[i].slot = i;
+            ios[i].len = sizeof(int);
+            ios[i].buf = (unsigned long)&nums[i];
+        }
+        batch.ios = (unsigned long)ios;
+        batch.count = 4;
+        if (ioctl(fd, CH_SLOT_BATCH_READ, &batch) == 4)
+        {
+            printf("Slots 0-3: %d %d %d %d\n", nums[0], nums[1], nums[2], nums[3]);
+        }
         //关闭"/dev/ch_device"
         close(fd);
     }
@@ -27,4 +52,4 @@ int main()
     {
         printf("Device open failure\n");
     }
-}
\ No newline at end of file
+}
@@ -9,13 +9,21 @@
 #include <linux/semaphore.h>
 #include <linux/wait.h>
 #include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/llist.h>
+#include <linux/atomic.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/poll.h>
+#include <linux/moduleparam.h>
+#include "ch_device_chat.h"
 
 MODULE_LICENSE("GPL");
 
 #define MAJOR_NUM 290
 #define MAX_MSG_LEN 256
 #define MAX_MSG_COUNT 64
-#define MAX_USER_NUMBER 16
+#define MAX_USER_NUMBER CHAT_MAX_USERS
 
 #define IINS -3
 #define COPY_ERR -2
@@ -24,8 +32,20 @@ MODULE_LICENSE("GPL");
 #define BUILD_ACCOUNT 1
 #define READ_ACCOUNT_INF 2
 
+// 唤醒合并：攒够 wake_batch 条消息或距第一条未唤醒的消息过去 wake_delay_us 微秒就唤醒一次，
+// wake_batch 为 1 时每条消息都立即唤醒。选择立即唤醒的会话在 urgent_wait 上等待，不受合并影响
+static unsigned int wake_batch = 1;
+static unsigned int wake_delay_us = 100;
+module_param(wake_batch, uint, 0644);
+MODULE_PARM_DESC(wake_batch, "wake readers after this many messages (1 = every message)");
+module_param(wake_delay_us, uint, 0644);
+MODULE_PARM_DESC(wake_delay_us, "wake readers at most this long after a message arrives");
+
 static struct semaphore sem;
 static wait_queue_head_t read_wait;
+static wait_queue_head_t urgent_wait;
+static struct hrtimer wake_timer;
+static atomic_t wake_pending = ATOMIC_INIT(0);  // 已追加但还没有唤醒过读者的消息数
 static spinlock_t msg_queue_lock;  // 用于保护消息队列的自旋锁
 
 struct chat_message {
@@ -38,6 +58,7 @@ struct user {
     pid_t pid;
     int head;
     int count;  // 当前未读消息的数量
+    int wake_mode;  // WAKE_COALESCED 或 WAKE_IMMEDIATE
 };
 
 struct message_queue {
@@ -48,28 +69,88 @@ struct message_queue {
 };
 
 static struct message_queue msg_queue;
+
+// 写入合并：并发的写者把准备好的消息挂到无锁链表上，抢到 combiner_active 的写者
+// 一次拿锁把整批消息追加进队列并只唤醒一次读者，其余写者等待自己的请求完成
+struct write_req {
+    struct llist_node node;
+    struct chat_message msg;
+    int ret;
+    int done;
+};
+static LLIST_HEAD(write_pending);
+#define COMBINE_MAX_ROUNDS 8  // 合并者最多连续处理的批数，之后交给下一个写者
+static atomic_t combiner_active = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(combine_wait);
+// 成员目录页，用户态只读映射，成员变化时在 sem 保护下发布新版本
+static struct chat_directory *directory;
 static ssize_t ch_device_read(struct file *, char *, size_t, loff_t*);
 static ssize_t ch_device_write(struct file *, const char *, size_t, loff_t*);
 static long ch_device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int ch_device_mmap(struct file *, struct vm_area_struct *);
+static unsigned int ch_device_poll(struct file *, poll_table *);
 static int ch_device_init(void);
 static void ch_device_exit(void);
 
 struct file_operations ch_device_fops = {
+    .owner = THIS_MODULE,   // 还有打开的文件或映射时不能卸载，目录页不会在映射期间被释放
     .read = ch_device_read,
     .write = ch_device_write,
     .unlocked_ioctl = ch_device_ioctl,
+    .mmap = ch_device_mmap,
+    .poll = ch_device_poll,
 };
 
+// 合并唤醒的超时到达：把攒下的消息一次性通知给读者
+static enum hrtimer_restart wake_timer_fn(struct hrtimer *timer)
+{
+    atomic_set(&wake_pending, 0);
+    wake_up_interruptible(&read_wait);
+    return HRTIMER_NORESTART;
+}
+
+// 追加消息后调用，调用者持有 sem
+static void wake_readers(int appended)
+{
+    unsigned int batch = READ_ONCE(wake_batch);
+
+    // 立即唤醒的会话不参与合并
+    wake_up_interruptible(&urgent_wait);
+
+    if (batch <= 1 || atomic_add_return(appended, &wake_pending) >= batch)
+    {
+        atomic_set(&wake_pending, 0);
+        hrtimer_try_to_cancel(&wake_timer);
+        wake_up_interruptible(&read_wait);
+    }
+    else if (!hrtimer_is_queued(&wake_timer))
+    {
+        hrtimer_start(&wake_timer, ns_to_ktime((u64)READ_ONCE(wake_delay_us) * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+    }
+}
+
 static int ch_device_init(void)
 {
     int ret;
+    BUILD_BUG_ON(CHAT_DIR_PAGE_SIZE != PAGE_SIZE);
+    BUILD_BUG_ON(sizeof(struct chat_directory) > PAGE_SIZE);
+    directory = (struct chat_directory *)get_zeroed_page(GFP_KERNEL);
+    if (!directory)
+    {
+        return -ENOMEM;
+    }
     sema_init(&sem, 1);
     init_waitqueue_head(&read_wait);
+    init_waitqueue_head(&urgent_wait);
+    hrtimer_init(&wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    wake_timer.function = wake_timer_fn;
     spin_lock_init(&msg_queue_lock);  // 初始化自旋锁
     ret = register_chrdev(MAJOR_NUM, "ch_device_chat", &ch_device_fops);
     if (ret)
     {
         printk("ch_device_chat register failure\n");
+        free_page((unsigned long)directory);
     } 
     else
     {
@@ -81,9 +162,44 @@ static int ch_device_init(void)
 static void ch_device_exit(void)
 {
     unregister_chrdev(MAJOR_NUM, "ch_device_chat");
+    hrtimer_cancel(&wake_timer);
+    free_page((unsigned long)directory);
     printk(KERN_INFO "ch_device module unloaded\n");
 }
 
+// 把当前成员列表发布到目录页，调用者需持有 sem。
+// 先把 seq 改成奇数再修改内容，改完再变回偶数，读者据此判断是否读到了一半
+static void directory_publish(void)
+{
+    int i;
+
+    WRITE_ONCE(directory->seq, directory->seq + 1);
+    smp_wmb();
+    for (i = 0; i < msg_queue.user_count; i++)
+    {
+        WRITE_ONCE(directory->pids[i], msg_queue.users[i].pid);
+    }
+    WRITE_ONCE(directory->count, msg_queue.user_count);
+    smp_wmb();
+    WRITE_ONCE(directory->seq, directory->seq + 1);
+}
+
+// 只允许只读映射整页，成员注册仍然通过 ioctl 完成
+static int ch_device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+    {
+        return -EINVAL;
+    }
+    if (vma->vm_flags & VM_WRITE)
+    {
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    return remap_pfn_range(vma, vma->vm_start, virt_to_phys(directory) >> PAGE_SHIFT,
+                           PAGE_SIZE, vma->vm_page_prot);
+}
+
 static ssize_t ch_device_read(struct file *filp, char *buf, size_t len, loff_t *off)
 {
     pid_t my_pid = current->pid;
@@ -143,28 +259,76 @@ static ssize_t ch_device_read(struct file *filp, char *buf, size_t len, loff_t *
     return bytes_read;
 }
 
+// 追加一批写请求，只获取一次信号量和自旋锁，只唤醒一次读者。
+// 设置 done 之后请求所在的栈可能立即失效，之后不能再访问该请求
+static void combine_writes(void)
+{
+    struct llist_node *batch;
+    struct write_req *req, *next;
+    int appended = 0;
+    int round;
+    int i;
+
+    down(&sem);
+    // 处理期间新到的请求也一并处理，直到链表为空或达到批数上限
+    for (round = 0; round < COMBINE_MAX_ROUNDS; round++)
+    {
+        batch = llist_del_all(&write_pending);
+        if (!batch)
+            break;
+        batch = llist_reverse_order(batch);  // 按到达顺序追加
+
+        spin_lock(&msg_queue_lock);
+        llist_for_each_entry_safe(req, next, batch, node)
+        {
+            if (msg_queue.tail >= MAX_MSG_COUNT)
+            {
+                req->ret = -ENOMEM;  // 队列已满
+            }
+            else
+            {
+                msg_queue.messages[msg_queue.tail] = req->msg;
+                msg_queue.tail = (msg_queue.tail + 1) % MAX_MSG_COUNT;
+                req->ret = 0;
+                appended++;
+                // 每个用户的未读数加一，队列绕回覆盖了最旧的未读消息时读指针跟着前移
+                for (i = 0; i < msg_queue.user_count; i++)
+                {
+                    struct user *u = &msg_queue.users[i];
+
+                    if (u->count == MAX_MSG_COUNT)
+                        u->head = (u->head + 1) % MAX_MSG_COUNT;
+                    else
+                        u->count++;
+                }
+            }
+            smp_store_release(&req->done, 1);
+        }
+        spin_unlock(&msg_queue_lock);
+    }
+
+    // 如果有用户在等待消息，则唤醒；整批只唤醒一次，并按配置进一步合并
+    if (appended)
+        wake_readers(appended);
+    up(&sem);
+}
+
 static ssize_t ch_device_write(struct file *filp, const char *buf, size_t len, loff_t *off)
 {
-    struct chat_message msg;
+    struct write_req req;
     size_t copy_size;
     char temp[MAX_MSG_LEN];
     int target_pid = 0;  // 默认群发
 
-    if (down_interruptible(&sem))
-    {
-        return -ERESTARTSYS;
-    }
-
     if (len > MAX_MSG_LEN)
     {
-        up(&sem);
         return -EINVAL;  // 超过最大消息长度
     }
 
+    // 复制和解析都在锁外完成，临界区里只剩追加
     copy_size = min(len, sizeof(temp) - 1);
     if (copy_from_user(temp, buf, copy_size))
     {
-        up(&sem);
         return -EFAULT;
     }
 
@@ -177,37 +341,37 @@ static ssize_t ch_device_write(struct file *filp, const char *buf, size_t len, l
         target_pid = simple_strtol(temp + 1, &endptr, 10);  // 提取目标 PID
         if (*endptr != ' ' && *endptr != '\0')
         {
-            up(&sem);
             return -EINVAL;  // 格式不正确
         }
 
         memmove(temp, endptr + 1, strlen(endptr + 1) + 1);  // 消息内容部分
     }
 
-    strncpy(msg.message, temp, MAX_MSG_LEN - 1);
-    msg.message[MAX_MSG_LEN - 1] = '\0';  // 确保消息以 '\0' 结尾
-    msg.sender_pid = current->pid;
-    msg.target_pid = target_pid;  // 设置目标 PID
-
-    // 将消息加入队列
-    spin_lock(&msg_queue_lock);
+    strncpy(req.msg.message, temp, MAX_MSG_LEN - 1);
+    req.msg.message[MAX_MSG_LEN - 1] = '\0';  // 确保消息以 '\0' 结尾
+    req.msg.sender_pid = current->pid;
+    req.msg.target_pid = target_pid;  // 设置目标 PID
+    req.done = 0;
 
-    if (msg_queue.tail >= MAX_MSG_COUNT)
+    // 发布请求后必须等它完成（请求在栈上），所以这里的等待不可中断；
+    // 合并者每批的工作量有限，不会等待太久
+    llist_add(&req.node, &write_pending);
+    while (!smp_load_acquire(&req.done))
     {
-        spin_unlock(&msg_queue_lock);
-        up(&sem);
-        return -ENOMEM;  // 队列已满
+        if (atomic_xchg(&combiner_active, 1) == 0)
+        {
+            combine_writes();
+            atomic_set(&combiner_active, 0);
+            // 唤醒请求已完成的写者；链表中如果还有晚到的请求，其写者醒来后会接任合并者
+            wake_up(&combine_wait);
+        }
+        else
+        {
+            wait_event(combine_wait, smp_load_acquire(&req.done) || !atomic_read(&combiner_active));
+        }
     }
 
-    msg_queue.messages[msg_queue.tail] = msg;
-    msg_queue.tail = (msg_queue.tail + 1) % MAX_MSG_COUNT;
-
-    // 如果有用户在等待消息，则唤醒
-    wake_up_interruptible(&read_wait);
-
-    spin_unlock(&msg_queue_lock);
-    up(&sem);
-    return len;
+    return req.ret ? req.ret : len;
 }
 
 static long ch_device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -224,26 +388,69 @@ static long ch_device_ioctl(struct file *file, unsigned int cmd, unsigned long a
             return -EFAULT;
         }
 
+        if (down_interruptible(&sem))
+        {
+            kfree(user_now);
+            return -ERESTARTSYS;
+        }
+
         if (msg_queue.user_count >= MAX_USER_NUMBER)
         {
+            up(&sem);
             kfree(user_now);
             return -ENOMEM;  // 用户数量超限
         }
 
         msg_queue.users[msg_queue.user_count].pid = user_now->pid;
-        msg_queue.users[msg_queue.user_count].head = 0;
+        // 新用户从当前队尾开始读，注册之前的消息和槽位里的旧数据都不可见
+        msg_queue.users[msg_queue.user_count].head = msg_queue.tail;
         msg_queue.users[msg_queue.user_count].count = 0;
+        msg_queue.users[msg_queue.user_count].wake_mode = WAKE_COALESCED;
         msg_queue.user_count++;
+        directory_publish();
 
+        up(&sem);
         kfree(user_now);
         return BUILD_SUCC;  // 返回成功
     }
     else if (cmd == READ_ACCOUNT_INF)
     {
-        if (copy_to_user((struct user *)arg, msg_queue.users, sizeof(struct user) * msg_queue.user_count))
+        // 旧接口，保留给还没改用目录页的程序；在锁内复制，避免与注册并发时读到一半
+        struct user users[MAX_USER_NUMBER];
+        int count;
+
+        if (down_interruptible(&sem))
+            return -ERESTARTSYS;
+        count = msg_queue.user_count;
+        memcpy(users, msg_queue.users, sizeof(struct user) * count);
+        up(&sem);
+
+        if (copy_to_user((struct user *)arg, users, sizeof(struct user) * count))
             return COPY_ERR;
 
-        return msg_queue.user_count;  // 返回当前用户数量
+        return count;  // 返回当前用户数量
+    }
+    else if (cmd == SET_WAKE_MODE)
+    {
+        // 对延迟敏感的读者可以退出唤醒合并，每条消息都立即被唤醒
+        int i;
+        int ret = -EINVAL;
+
+        if (arg != WAKE_COALESCED && arg != WAKE_IMMEDIATE)
+            return -EINVAL;
+        if (down_interruptible(&sem))
+            return -ERESTARTSYS;
+        for (i = 0; i < msg_queue.user_count; i++)
+        {
+            if (msg_queue.users[i].pid == current->pid)
+            {
+                msg_queue.users[i].wake_mode = arg;
+                ret = 0;
+                break;
+            }
+        }
+        up(&sem);
+        return ret;
     }
     else
     {
@@ -251,5 +458,45 @@ static long ch_device_ioctl(struct file *file, unsigned int cmd, unsigned long a
     }
 }
 
+// 已注册的用户有发给自己的未读消息时可读。按用户的唤醒方式选择等待队列
+static unsigned int ch_device_poll(struct file *filp, poll_table *wait)
+{
+    unsigned int mask = POLLOUT | POLLWRNORM;
+    struct user *user = NULL;
+    int i;
+
+    down(&sem);
+    for (i = 0; i < msg_queue.user_count; i++)
+    {
+        if (msg_queue.users[i].pid == current->pid)
+        {
+            user = &msg_queue.users[i];
+            break;
+        }
+    }
+    if (user)
+    {
+        poll_wait(filp, user->wake_mode == WAKE_IMMEDIATE ? &urgent_wait : &read_wait, wait);
+        // 发给其他用户的私聊读的时候也会跳过，这里先跳过，只剩它们时不报告可读
+        while (user->count > 0)
+        {
+            pid_t target = msg_queue.messages[user->head % MAX_MSG_COUNT].target_pid;
+
+            if (target == 0 || target == current->pid)
+                break;
+            user->head = (user->head + 1) % MAX_MSG_COUNT;
+            user->count--;
+        }
+        if (user->count > 0)
+            mask |= POLLIN | POLLRDNORM;
+    }
+    else
+    {
+        mask |= POLLERR;  // 未注册的进程不能读
+    }
+    up(&sem);
+    return mask;
+}
+
 module_init(ch_device_init);
 module_exit(ch_device_exit);
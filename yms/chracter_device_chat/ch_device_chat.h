@@ -0,0 +1,46 @@
+#ifndef CH_DEVICE_CHAT_H
+#define CH_DEVICE_CHAT_H
+
+// ch_device_chat 模块与用户态程序共用的接口定义
+#include <linux/types.h>
+
+#define CHAT_MAX_USERS 16
+#define CHAT_DIR_PAGE_SIZE 4096
+
+// 成员目录页：用户态 mmap 只读映射后直接读取，不需要系统调用。
+// seq 为奇数时内核正在更新，为偶数时内容稳定；成员每变化一次 seq 加 2，
+// 代数 generation = seq / 2，客户端只在代数变化时才需要重新读取成员列表
+struct chat_directory
+{
+    __u32 seq;
+    __u32 count;
+    __s32 pids[CHAT_MAX_USERS];
+};
+
+// ioctl 命令，与 BUILD_ACCOUNT(1)、READ_ACCOUNT_INF(2) 编号连续
+#define SET_WAKE_MODE 3     // 参数为 WAKE_COALESCED 或 WAKE_IMMEDIATE，作用于调用进程的账户
+#define WAKE_COALESCED 0    // 默认：按模块参数 wake_batch / wake_delay_us 合并唤醒
+#define WAKE_IMMEDIATE 1    // 每条消息都立即唤醒
+
+#ifndef __KERNEL__
+// 读出目录的一致快照并返回其 seq：读到奇数或读的过程中 seq 变化都要重读
+static inline __u32 chat_dir_read(const struct chat_directory *dir, struct chat_directory *out)
+{
+    __u32 seq;
+
+    for (;;)
+    {
+        seq = __atomic_load_n(&dir->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        __builtin_memcpy(out, dir, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&dir->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+    out->seq = seq;
+    return seq;
+}
+#endif
+
+#endif
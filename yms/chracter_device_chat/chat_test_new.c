@@ -7,11 +7,13 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <signal.h>
+#include "ch_device_chat.h"
 
 #define DEVICE "/dev/ch_device_chat"
 #define MAX_MSG_LEN 256
-#define MAX_USER_NUMBER 16
+#define MAX_USER_NUMBER CHAT_MAX_USERS
 
 #define IINS -3
 #define COPY_ERR -2
@@ -26,10 +28,32 @@
 void send_message();
 void read_message();
 
-pid_t userpid[MAX_USER_NUMBER];
-int user_index = 0;
 int fd;
 
+// 本进程 fork 出的子进程，退出时只结束这些进程；目录页中可能还有其他程序注册的用户
+pid_t children[MAX_USER_NUMBER];
+int child_count = 0;
+
+// 成员目录直接读内核映射的只读页，本地副本只在代数变化时刷新
+const struct chat_directory *directory;
+struct chat_directory members;
+
+void refresh_members()
+{
+    if (__atomic_load_n(&directory->seq, __ATOMIC_ACQUIRE) != members.seq)
+        chat_dir_read(directory, &members);
+}
+
+int is_member(pid_t pid)
+{
+    refresh_members();
+    for (__u32 i = 0; i < members.count; i++) {
+        if (members.pids[i] == pid)
+            return 1;
+    }
+    return 0;
+}
+
 struct chat_message {
     pid_t target_pid;
     char message[MAX_MSG_LEN];
@@ -135,7 +159,9 @@ void build_account() {
     }
 
     if (pid > 0) {
-        userpid[user_index++] = pid;
+        // 成员以目录页为准，这里只记下子进程，退出时用来结束它们
+        if (child_count < MAX_USER_NUMBER)
+            children[child_count++] = pid;
         printf("Created account for user with PID %d.\n", pid);
     } else {
         printf("Failed to fork a new process!\n");
@@ -149,14 +175,7 @@ void send_sig() {
     getchar();
 
     // 检查源用户是否存在
-    int source_found = 0;
-    for (int i = 0; i < user_index; i++) {
-        if (userpid[i] == source_pid) {
-            source_found = 1;
-            break;
-        }
-    }
-    if (!source_found) {
+    if (!is_member(source_pid)) {
         printf("No user with PID %d found as source.\n", source_pid);
         return;
     }
@@ -171,14 +190,7 @@ void read_sig() {
     getchar();
 
     // 检查目标用户是否存在
-    int read_found = 0;
-    for (int i = 0; i < user_index; i++) {
-        if (userpid[i] == read_pid) {
-            read_found = 1;
-            break;
-        }
-    }
-    if (!read_found) {
+    if (!is_member(read_pid)) {
         printf("No user with PID %d found to read.\n", read_pid);
         return;
     }
@@ -239,11 +251,12 @@ void send_message()
     {
         // 群发消息
         printf("Sending group message to all users except sender...\n");
-        for (int i = 0; i < user_index; i++)
+        refresh_members();
+        for (__u32 i = 0; i < members.count; i++)
         {
-            if (userpid[i] != getpid())
+            if (members.pids[i] != getpid())
             {
-                msg.target_pid = userpid[i];
+                msg.target_pid = members.pids[i];
                 strncpy(msg.message, message, MAX_MSG_LEN - 1);
                 msg.message[MAX_MSG_LEN - 1] = '\0';
 
@@ -264,9 +277,9 @@ void do_exit()
 {
     int i;
     int status;
-    for(i = 0; i < user_index; i++)
+    for(i = 0; i < child_count; i++)
     {
-        pid_t pid = userpid[i];
+        pid_t pid = children[i];
         kill(pid, SIGTERM);
         waitpid(pid, &status, WNOHANG);
         printf("Child process with PID %d terminated.\n", pid);
@@ -281,6 +294,14 @@ int main() {
         return -1;
     }
 
+    directory = mmap(NULL, CHAT_DIR_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (directory == MAP_FAILED) {
+        perror("Failed to map member directory");
+        close(fd);
+        return -1;
+    }
+    members.seq = 1;    // 奇数不会与内核发布的值相同，保证第一次一定读取
+
     signal(SIGUSR1, signal_handler_read);  // Set up signal handler
     signal(SIGUSR2, signal_handler_write); // Set up another signal handler
     display_menu();
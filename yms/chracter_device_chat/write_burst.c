@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+// 多写者突发压测：所有线程同时开始，各自连续写入固定数量的消息，
+// 统计总吞吐，用来观察写入合并在高并发下的效果
+// 用法：./write_burst [线程数] [每线程消息数]
+
+#define DEVICE "/dev/ch_device_chat"
+#define MAX_MSG_LEN 256
+
+static int fd;
+static int per_thread;
+// 起跑线：主线程创建完所有线程后置为 1 一起开始；创建失败时置为 -1，已创建的线程直接退出
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int start_line;
+
+static void start_set(int value)
+{
+    pthread_mutex_lock(&start_lock);
+    start_line = value;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&start_lock);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg)
+{
+    long id = (long)arg;
+    char msg[MAX_MSG_LEN];
+    long failed = 0;
+    int i, len, go;
+
+    pthread_mutex_lock(&start_lock);
+    while (!start_line)
+        pthread_cond_wait(&start_cond, &start_lock);
+    go = start_line > 0;
+    pthread_mutex_unlock(&start_lock);
+    if (!go)
+        return NULL;
+    for (i = 0; i < per_thread; i++)
+    {
+        len = snprintf(msg, sizeof(msg), "writer %ld msg %d", id, i);
+        if (write(fd, msg, len) < 0)
+            failed++;
+    }
+    return (void *)failed;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = argc > 1 ? atoi(argv[1]) : 32;
+    pthread_t *threads;
+    long failed = 0;
+    double start, elapsed;
+    void *ret;
+    int i;
+
+    per_thread = argc > 2 ? atoi(argv[2]) : 100000;
+    if (nthreads <= 0 || per_thread <= 0)
+    {
+        printf("usage: %s [threads] [messages per thread]\n", argv[0]);
+        return 1;
+    }
+
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0)
+    {
+        perror("Failed to open device");
+        return 1;
+    }
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, writer, (void *)(long)i) != 0)
+        {
+            perror("Failed to create writer thread");
+            start_set(-1);
+            while (i--)
+                pthread_join(threads[i], NULL);
+            free(threads);
+            close(fd);
+            return 1;
+        }
+    }
+
+    start = now_sec();
+    start_set(1);
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], &ret);
+        failed += (long)ret;
+    }
+    elapsed = now_sec() - start;
+
+    printf("%d writers x %d messages: %.3f s, %.0f msg/s, %ld failed\n", nthreads, per_thread,
+           elapsed, (double)nthreads * per_thread / elapsed, failed);
+
+    free(threads);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef CHAT_SYSCALL_H
+#define CHAT_SYSCALL_H
+
+// 聊天专用系统调用的编号，模块以 chat_syscalls=1 加载且 chat_device 已加载时有效。
+// 用法：
+//   syscall(CHAT_SEND_SYSCALL_NO, token, target_pid, buf, len, flags)，返回 len
+//   syscall(CHAT_RECV_SYSCALL_NO, token, buf, len)，返回消息长度
+// token 由 /dev/chat_device 上的 CHAT_GET_TOKEN 取得，flags 见 chat_device.h 中的 CHAT_SEND_*，
+// target_pid 为 0 表示群发
+
+// arm64 上 244 起的体系结构保留号没有使用，表项指向 sys_ni_syscall
+#define CHAT_SEND_SYSCALL_NO 244
+#define CHAT_RECV_SYSCALL_NO 245
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "chat_syscall.h"
+#include "../../succeed_version_sem/chat_device.h"
+
+// 比较 /dev/chat_device 的 write/read 与 chat_send/chat_recv 专用系统调用在小消息下的单次开销
+// 用法：./chat_syscall_bench [每种大小的次数]
+// 需要先加载 chat_device，再以 chat_syscalls=1 加载 modify_syscall。
+// 每次迭代发一条群发消息再把它读回来，队列中始终最多一条，不受环形队列容量影响
+
+#define DEVICE "/dev/chat_device"
+
+static const int sizes[] = { 8, 32, 64, 128, 255 };
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 返回每次迭代的耗时，出错返回 -1
+static double run_vfs(int fd, const char *msg, int len, int total, long long *send_ns)
+{
+    char buf[256];
+    long long start, t;
+    int i;
+
+    *send_ns = 0;
+    start = now_ns();
+    for (i = 0; i < total; i++)
+    {
+        t = now_ns();
+        if (write(fd, msg, len) != len)
+            return -1;
+        *send_ns += now_ns() - t;
+        if (read(fd, buf, sizeof(buf)) != len)
+            return -1;
+    }
+    return (double)(now_ns() - start) / total;
+}
+
+static double run_syscall(unsigned long long token, const char *msg, int len, int total, long long *send_ns)
+{
+    char buf[256];
+    long long start, t;
+    int i;
+
+    *send_ns = 0;
+    start = now_ns();
+    for (i = 0; i < total; i++)
+    {
+        t = now_ns();
+        if (syscall(CHAT_SEND_SYSCALL_NO, token, 0, msg, len, 0) != len)
+            return -1;
+        *send_ns += now_ns() - t;
+        if (syscall(CHAT_RECV_SYSCALL_NO, token, buf, sizeof(buf)) != len)
+            return -1;
+    }
+    return (double)(now_ns() - start) / total;
+}
+
+int main(int argc, char *argv[])
+{
+    int total = argc > 1 ? atoi(argv[1]) : 200000;
+    unsigned long long token;
+    char msg[256];
+    long long vfs_send, sc_send;
+    double vfs, sc;
+    unsigned int i;
+    int fd;
+
+    if (total <= 0)
+    {
+        printf("usage: %s [iterations per size]\n", argv[0]);
+        return 1;
+    }
+
+    // 非阻塞打开：读不到消息时直接报错，不会卡住
+    fd = open(DEVICE, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        perror("Failed to open device");
+        return 1;
+    }
+    if (ioctl(fd, CHAT_GET_TOKEN, &token) < 0)
+    {
+        perror("CHAT_GET_TOKEN");
+        return 1;
+    }
+
+    // 先读空设备中已有的消息
+    while (read(fd, msg, sizeof(msg)) > 0)
+        ;
+
+    // 消息内容不以 '@'、'!'、'#' 开头，两条路径入队的是同样的群发消息
+    memset(msg, 'x', sizeof(msg));
+
+    printf("%-6s %-14s %-14s %-14s %-14s %-8s\n", "bytes", "write ns", "chat_send ns",
+           "write+read", "send+recv", "speedup");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        vfs = run_vfs(fd, msg, sizes[i], total, &vfs_send);
+        if (vfs < 0)
+        {
+            perror("device path failed");
+            return 1;
+        }
+        sc = run_syscall(token, msg, sizes[i], total, &sc_send);
+        if (sc < 0)
+        {
+            perror("chat syscalls failed (module loaded with chat_syscalls=1?)");
+            return 1;
+        }
+        printf("%-6d %-14.1f %-14.1f %-14.1f %-14.1f %-8.2f\n", sizes[i], (double)vfs_send / total,
+               (double)sc_send / total, vfs, sc, vfs / sc);
+    }
+
+    close(fd);
+    return 0;
+}
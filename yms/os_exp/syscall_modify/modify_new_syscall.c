@@ -1,9 +1,23 @@
 #include<stdio.h>
 #include<sys/time.h>
 #include<unistd.h>
+#include<sys/syscall.h>
+#include"multicall.h"
 int main()
 { 
-	int ret=syscall(78,10,20); //after modify syscall 78
+	struct mc_op ops[3] = {0};
+	int ret, i;
+
+	ops[0].op = SYS_getpid;
+	ops[1].op = SYS_gettid;
+	ops[2].op = MC_OP_CHAT_SEND;	//写到标准输出
+	ops[2].args[0] = 1;
+	ops[2].args[1] = (long)"multicall\n";
+	ops[2].args[2] = 10;
+
+	ret=syscall(MC_SYSCALL_NO,ops,3,0); //after modify syscall 78: multicall
 	printf("%d\n",ret);
+	for(i=0;i<3;i++)
+		printf("op %d: %lld\n",ops[i].op,(long long)ops[i].ret);
 	return 0;
 }
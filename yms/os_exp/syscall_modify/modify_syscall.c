@@ -10,84 +10,546 @@
 #include <linux/uaccess.h>
 #include <asm/paravirt.h>
 #include <linux/kallsyms.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/delay.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <asm/syscall.h>
+#include "multicall.h"
+#include "chat_syscall.h"
 
-#define sys_No 78  // 系统调用编号
+#define sys_No MC_SYSCALL_NO  // 系统调用编号
+#define MC_CHUNK 8           // 每次从用户空间拷贝的操作描述符数量
+
+// 插桩：对任意一组系统调用套一层包装，统计每个 CPU 上的调用次数和耗时直方图
+#define MAX_INTERPOSE 16
+#define LAT_BUCKETS 32      // 第 i 个桶统计 [2^i, 2^(i+1)) ns
+
+static int interpose[MAX_INTERPOSE];
+static int interpose_num;
+module_param_array(interpose, int, &interpose_num, 0444);
+MODULE_PARM_DESC(interpose, "syscall numbers to profile, e.g. interpose=63,64");
+
+struct interpose_stat
+{
+    u64 count;
+    u64 total_ns;
+    u64 buckets[LAT_BUCKETS];
+};
+
+// 每个 CPU 一份，避免热路径上的共享缓存行和锁
+struct interpose_stats
+{
+    struct interpose_stat slot[MAX_INTERPOSE];
+};
+
+static struct interpose_stats __percpu *stats;
+static unsigned long interpose_orig[MAX_INTERPOSE];   // 被包装的原始处理函数
+static s8 interpose_slot[__NR_syscalls];               // 系统调用号 -> 槽位，-1 表示未包装
+static atomic_t interpose_inflight = ATOMIC_INIT(0);   // 正在包装函数中执行的调用数
+
+// 聊天专用系统调用：直接调用 chat_device 模块导出的队列接口，不经过 VFS
+static bool chat_syscalls;
+module_param(chat_syscalls, bool, 0444);
+MODULE_PARM_DESC(chat_syscalls, "install chat_send/chat_recv syscalls, chat_device must be loaded first");
+
+typedef long (*chat_send_fn)(u64 token, pid_t target, const char __user *buf, size_t size, unsigned int flags);
+typedef long (*chat_recv_fn)(u64 token, char __user *buf, size_t size);
+
+static chat_send_fn chat_send_core;
+static chat_recv_fn chat_recv_core;
+static atomic_t chat_inflight = ATOMIC_INIT(0);        // 正在 chat_send/chat_recv 中执行的调用数
+static atomic_t mc_inflight = ATOMIC_INIT(0);          // 正在 multicall 中执行的调用数
 
-unsigned long old_sys_call_func;  // 修改为 unsigned long 类型，保存原始的系统调用地址
 unsigned long *p_sys_call_table = 0;
-unsigned long *sys_call_addr; 
-unsigned long start_rodata;
-unsigned long init_begin;
-void (*update_mapping_prot)(phys_addr_t phys, unsigned long virt, phys_addr_t size, pgprot_t prot);
-#define section_size init_begin - start_rodata
 
-// 关闭写保护
-static void disable_write_protection(void)
+// 补丁管理：所有要修改的表项先登记，再在同一个写窗口内一次完成
+#define MAX_PATCHES (MAX_INTERPOSE + 3)
+#define TABLE_PAGES (DIV_ROUND_UP(__NR_syscalls * sizeof(unsigned long), PAGE_SIZE) + 1)
+
+struct syscall_patch
 {
-     update_mapping_prot(__pa_symbol(start_rodata), (unsigned long)start_rodata, section_size, PAGE_KERNEL);
+    int nr;
+    unsigned long func;     // 要写入的新处理函数
+    unsigned long old;      // 原始处理函数，恢复时写回
+};
+
+static struct syscall_patch patches[MAX_PATCHES];
+static int patch_num;
+
+static void patch_add(int nr, unsigned long func)
+{
+    patches[patch_num].nr = nr;
+    patches[patch_num].func = func;
+    patches[patch_num].old = p_sys_call_table[nr];
+    patch_num++;
 }
 
-// 打开写保护
-static void enable_write_protection(void)
+// 写窗口：不再修改整个 rodata 段的页表属性，而是把被修改表项所在的物理页
+// 临时 vmap 成一个可写的别名，写完后 vunmap，只刷新别名这几页的 TLB
+static int apply_syscall_patches(int restore)
 {
-    update_mapping_prot(__pa_symbol(start_rodata), (unsigned long)start_rodata, section_size, PAGE_KERNEL_RO);
+    struct page *pages[TABLE_PAGES];
+    unsigned long lo = ULONG_MAX;
+    unsigned long hi = 0;
+    unsigned long first;
+    int npages;
+    void *alias;
+    int i;
+
+    if (patch_num == 0)
+        return 0;
+
+    for (i = 0; i < patch_num; i++)
+    {
+        unsigned long addr = (unsigned long)&p_sys_call_table[patches[i].nr];
+
+        lo = min(lo, addr);
+        hi = max(hi, addr + sizeof(unsigned long));
+    }
+    first = lo & PAGE_MASK;
+    npages = (PAGE_ALIGN(hi) - first) >> PAGE_SHIFT;
+
+    // 内核映像在物理上连续，逐页取出对应的 page
+    for (i = 0; i < npages; i++)
+    {
+        pages[i] = pfn_to_page(PHYS_PFN(__pa_symbol(first)) + i);
+    }
+
+    alias = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+    if (!alias)
+        return -ENOMEM;
+
+    for (i = 0; i < patch_num; i++)
+    {
+        unsigned long offset = (unsigned long)&p_sys_call_table[patches[i].nr] - first;
+
+        WRITE_ONCE(*(unsigned long *)(alias + offset), restore ? patches[i].old : patches[i].func);
+    }
+
+    vunmap(alias);
+    printk("syscall patch: %s %d entries through %d page(s)\n", restore ? "restored" : "applied", patch_num, npages);
+    return 0;
 }
 
-// 新的系统调用处理函数
-asmlinkage int hello(/* int *a, int *b */void) {
-    int a = (int)current_pt_regs()->regs[0]; // 从寄存器 r0 获取参数 a
-    int b = (int)current_pt_regs()->regs[1]; // 从寄存器 r1 获取参数 b
-    
-    printk("No 78 syscall has changed to hello\n");
-    printk("a: %d, b: %d\n", a, b);
-    
-    return a + b; // 返回 a 和 b 的和
+// multicall 允许批量执行的系统调用：只收录参数简单、不会改变进程结构的调用
+static int mc_allowed(int nr)
+{
+    switch (nr)
+    {
+    case __NR_read:
+    case __NR_write:
+    case __NR_pread64:
+    case __NR_pwrite64:
+    case __NR_lseek:
+    case __NR_ioctl:
+    case __NR_getpid:
+    case __NR_gettid:
+    case __NR_clock_gettime:
+    case __NR_sched_yield:
+        return 1;
+    default:
+        return 0;
+    }
 }
 
-// 修改系统调用表
-void modify_syscall(void)
-{   
-    // 获取内核符号
-    update_mapping_prot = (void *)kallsyms_lookup_name("update_mapping_prot");
-    start_rodata = (unsigned long)kallsyms_lookup_name("__start_rodata");
-    init_begin = (unsigned long)kallsyms_lookup_name("__init_begin");
+// 用伪造的 pt_regs 直接调用系统调用表中的处理函数，参数中的用户指针仍然有效
+static long mc_dispatch(struct mc_op *op)
+{
+    struct pt_regs regs;
+    int nr = op->op;
+    int i;
+
+    if (nr == MC_OP_CHAT_SEND)
+        nr = __NR_write;
+    else if (nr == MC_OP_CHAT_RECV)
+        nr = __NR_read;
+    else if (!mc_allowed(nr))
+        return -ENOSYS;
+
+    memset(&regs, 0, sizeof(regs));
+    for (i = 0; i < 6; i++)
+    {
+        regs.regs[i] = op->args[i];
+    }
+    regs.syscallno = nr;
+    return ((syscall_fn_t)p_sys_call_table[nr])(&regs);
+}
+
+// 被信号打断的操作不能由内核重启（重启的是整个 multicall），统一报告为 -EINTR
+static long mc_result(long ret)
+{
+    switch (ret)
+    {
+    case -ERESTARTSYS:
+    case -ERESTARTNOINTR:
+    case -ERESTARTNOHAND:
+    case -ERESTART_RESTARTBLOCK:
+        return -EINTR;
+    default:
+        return ret;
+    }
+}
+
+static long multicall_run(struct mc_op __user *uops, int n, int flags)
+{
+    struct mc_op ops[MC_CHUNK];
+    int done = 0;
+    int chunk;
+    int i;
+
+    if (n < 0 || n > MC_MAX_OPS)
+        return -EINVAL;
+
+    while (done < n)
+    {
+        chunk = min(n - done, MC_CHUNK);
+        if (copy_from_user(ops, uops + done, chunk * sizeof(struct mc_op)))
+            return done ? done : -EFAULT;
+
+        for (i = 0; i < chunk; i++)
+        {
+            ops[i].ret = mc_result(mc_dispatch(&ops[i]));
+            if (put_user(ops[i].ret, &uops[done + i].ret))
+                return done + i ? done + i : -EFAULT;
+
+            if (ops[i].ret < 0 && (flags & MC_STOP_ON_ERROR))
+                return done + i + 1;
+            // 有信号待处理时后面的阻塞操作都会立即失败，先返回让用户态处理信号
+            if (signal_pending(current))
+                return done + i + 1;
+        }
+        done += chunk;
+        cond_resched();
+    }
+
+    return done;
+}
+
+// 新的系统调用处理函数：一次陷入内核执行一组操作，摊薄用户态/内核态切换的开销。
+// 操作中可能有阻塞的读，与 interpose_entry 一样持有模块引用，有调用阻塞时 rmmod 直接失败
+asmlinkage long multicall(void)
+{
+    struct mc_op __user *uops = (struct mc_op __user *)current_pt_regs()->regs[0]; // 从寄存器 r0 获取操作数组
+    int n = (int)current_pt_regs()->regs[1];     // 从寄存器 r1 获取操作数量
+    int flags = (int)current_pt_regs()->regs[2]; // 从寄存器 r2 获取标志
+    bool pinned;
+    long ret;
+
+    atomic_inc(&mc_inflight);
+    pinned = try_module_get(THIS_MODULE);
+    ret = multicall_run(uops, n, flags);
+    if (pinned)
+        module_put(THIS_MODULE);
+    atomic_dec(&mc_inflight);
+    return ret;
+}
+
+// chat_send/chat_recv 调用期间同样持有模块引用，阻塞在 chat_recv 中的调用让 rmmod 直接失败。
+// chat_send(token, target, buf, len, flags)
+static asmlinkage long chat_send(const struct pt_regs *regs)
+{
+    bool pinned;
+    long ret;
+
+    atomic_inc(&chat_inflight);
+    pinned = try_module_get(THIS_MODULE);
+    ret = chat_send_core(regs->regs[0], (pid_t)regs->regs[1], (const char __user *)regs->regs[2],
+                         regs->regs[3], regs->regs[4]);
+    if (pinned)
+        module_put(THIS_MODULE);
+    atomic_dec(&chat_inflight);
+    return ret;
+}
+
+// chat_recv(token, buf, len)
+static asmlinkage long chat_recv(const struct pt_regs *regs)
+{
+    bool pinned;
+    long ret;
+
+    atomic_inc(&chat_inflight);
+    pinned = try_module_get(THIS_MODULE);
+    ret = chat_recv_core(regs->regs[0], (char __user *)regs->regs[1], regs->regs[2]);
+    if (pinned)
+        module_put(THIS_MODULE);
+    atomic_dec(&chat_inflight);
+    return ret;
+}
+
+// 通用包装函数：根据 syscallno 找到原处理函数，调用并记录耗时。
+// 调用期间持有模块引用，有调用阻塞在包装函数中时 rmmod 直接失败，而不是一直等下去；
+// 模块已开始卸载时取不到引用，这样的调用只由 interpose_inflight 计数，卸载时等它们返回
+static asmlinkage long interpose_entry(const struct pt_regs *regs)
+{
+    struct interpose_stat *st;
+    bool pinned;
+    int slot;
+    u64 start;
+    u64 delta;
+    long ret;
+
+    atomic_inc(&interpose_inflight);
+    pinned = try_module_get(THIS_MODULE);
+    slot = interpose_slot[regs->syscallno];
+    start = ktime_get_ns();
+    ret = ((syscall_fn_t)interpose_orig[slot])(regs);
+    delta = ktime_get_ns() - start;
+
+    st = &get_cpu_ptr(stats)->slot[slot];
+    st->count++;
+    st->total_ns += delta;
+    st->buckets[min_t(int, delta ? ilog2(delta) : 0, LAT_BUCKETS - 1)]++;
+    put_cpu_ptr(stats);
+
+    if (pinned)
+        module_put(THIS_MODULE);
+    atomic_dec(&interpose_inflight);
+    return ret;
+}
+
+// /proc/syscall_profile：汇总所有 CPU 的统计
+static int profile_proc_show(struct seq_file *m, void *v)
+{
+    struct interpose_stat sum;
+    u64 seen;
+    int slot;
+    int cpu;
+    int i;
+
+    seq_printf(m, "%-6s %-12s %-10s %-12s %-12s\n", "nr", "calls", "avg_ns", "p50_ns<", "p99_ns<");
+    for (slot = 0; slot < interpose_num; slot++)
+    {
+        u64 p50 = 0;
+        u64 p99 = 0;
 
+        memset(&sum, 0, sizeof(sum));
+        for_each_possible_cpu(cpu)
+        {
+            struct interpose_stat *st = &per_cpu_ptr(stats, cpu)->slot[slot];
+
+            sum.count += st->count;
+            sum.total_ns += st->total_ns;
+            for (i = 0; i < LAT_BUCKETS; i++)
+                sum.buckets[i] += st->buckets[i];
+        }
+
+        // 用桶的上界估计分位数
+        seen = 0;
+        for (i = 0; i < LAT_BUCKETS && sum.count; i++)
+        {
+            seen += sum.buckets[i];
+            if (!p50 && seen * 2 >= sum.count)
+                p50 = 2ULL << i;
+            if (!p99 && seen * 100 >= sum.count * 99)
+                p99 = 2ULL << i;
+        }
+
+        seq_printf(m, "%-6d %-12llu %-10llu %-12llu %-12llu\n", interpose[slot], sum.count,
+                   sum.count ? div64_u64(sum.total_ns, sum.count) : 0, p50, p99);
+    }
+    // 不为 0 时 rmmod 会失败，需要先让这些调用返回
+    seq_printf(m, "in flight: %d\n", atomic_read(&interpose_inflight));
+    return 0;
+}
+
+// 获取内核符号
+static int lookup_symbols(void)
+{
     // 获取系统调用表地址
     p_sys_call_table = (unsigned long *)kallsyms_lookup_name("sys_call_table");
     printk("p_sys_call_addr: %p\n", p_sys_call_table);
-    
-    // 获取指定系统调用的地址
-    sys_call_addr = &(p_sys_call_table[sys_No]);  // sys_call_addr 指向 sys_call_table[sys_No]
-    
-    // 保存原始的系统调用函数地址
-    old_sys_call_func = *sys_call_addr;  
-    printk("old_sys_call_func: %lx\n", old_sys_call_func);
-    printk("&hello: %p\n", &hello);
-
-    // 禁用写保护，修改系统调用表
-    disable_write_protection();
-    
-    // 将 sys_call_table[sys_No] 指向 hello 函数
-    *sys_call_addr = (unsigned long)&hello;  // 修改 sys_call_table[sys_No] 为 hello 函数的地址
-    
-    printk("*sys_call_addr: %lx\n", *sys_call_addr);  // 打印修改后的系统调用地址
-    
-    // 恢复写保护
-    enable_write_protection();
-}
-
-// 恢复原始系统调用
+
+    if (!p_sys_call_table)
+        return -ENOENT;
+    return 0;
+}
+
+// 修改系统调用表：multicall 与所有包装条目在同一个写窗口内完成
+int modify_syscall(void)
+{   
+    int slot;
+
+    printk("old_sys_call_func: %lx\n", p_sys_call_table[sys_No]);
+    printk("&multicall: %p\n", &multicall);
+
+    // 将 sys_call_table[sys_No] 指向 multicall 函数
+    patch_add(sys_No, (unsigned long)&multicall);
+    for (slot = 0; slot < interpose_num; slot++)
+    {
+        patch_add(interpose[slot], (unsigned long)&interpose_entry);
+    }
+    if (chat_syscalls)
+    {
+        patch_add(CHAT_SEND_SYSCALL_NO, (unsigned long)&chat_send);
+        patch_add(CHAT_RECV_SYSCALL_NO, (unsigned long)&chat_recv);
+    }
+
+    return apply_syscall_patches(0);
+}
+
+// 等已进入的调用返回，每 5 秒报告一次还剩多少，便于找出卡住卸载的进程
+static void drain_inflight(atomic_t *inflight, const char *what)
+{
+    int waited = 0;
+
+    while (atomic_read(inflight) > 0)
+    {
+        if (++waited % 500 == 0)
+            printk(KERN_WARNING "%s: still waiting for %d calls to return\n", what, atomic_read(inflight));
+        msleep(10);
+    }
+}
+
+// 等所有任务都经过一次主动调度或回到用户态。计数在处理函数的第一条语句才增加、
+// 在最后一条语句之前减少，刚进入还没计数和计数已减少还没返回的调用都靠它等待
+static void syscall_grace_period(void)
+{
+#ifdef CONFIG_TASKS_RCU
+    synchronize_rcu_tasks();
+#else
+    synchronize_rcu();
+#endif
+}
+
+// 恢复原始系统调用，并等已进入 multicall 的调用返回
 void restore_syscall(void)
 {
-    disable_write_protection();
-    *sys_call_addr = old_sys_call_func; // 恢复原始的系统调用地址
-    enable_write_protection();
+    apply_syscall_patches(1);
+    syscall_grace_period();
+    drain_inflight(&mc_inflight, "multicall");
+}
+
+// 检查 interpose 参数并准备统计数据，表项的替换由 modify_syscall 统一完成
+static int interpose_install(void)
+{
+    int slot;
+
+    memset(interpose_slot, -1, sizeof(interpose_slot));
+    for (slot = 0; slot < interpose_num; slot++)
+    {
+        int nr = interpose[slot];
+
+        if (nr < 0 || nr >= __NR_syscalls || nr == sys_No || interpose_slot[nr] >= 0 ||
+            (chat_syscalls && (nr == CHAT_SEND_SYSCALL_NO || nr == CHAT_RECV_SYSCALL_NO)))
+        {
+            printk("interpose: invalid or duplicate syscall %d\n", nr);
+            return -EINVAL;
+        }
+        // 不返回的系统调用会让计数和模块引用永远无法归零，模块再也不能卸载
+        if (nr == __NR_exit || nr == __NR_exit_group)
+        {
+            printk("interpose: syscall %d does not return and cannot be wrapped\n", nr);
+            return -EINVAL;
+        }
+        interpose_slot[nr] = slot;
+        interpose_orig[slot] = p_sys_call_table[nr];
+    }
+
+    stats = alloc_percpu(struct interpose_stats);
+    if (!stats)
+        return -ENOMEM;
+
+    if (!proc_create_single("syscall_profile", 0444, NULL, profile_proc_show))
+    {
+        free_percpu(stats);
+        return -ENOMEM;
+    }
+
+    printk("interpose: wrapping %d syscalls\n", interpose_num);
+    return 0;
+}
+
+// 表项已由 restore_syscall 恢复，这里只负责释放统计数据
+static void interpose_remove(void)
+{
+    // 阻塞在包装函数中的调用持有模块引用，会让 rmmod 失败，走到这里时只剩
+    // 模块开始卸载后才进入的调用，它们返回之前不能释放代码和统计数据
+    drain_inflight(&interpose_inflight, "interpose");
+
+    remove_proc_entry("syscall_profile", NULL);
+    free_percpu(stats);
+}
+
+// 取得 chat_device 导出的接口并持有模块引用，chat_device 在这些系统调用卸下之前不能卸载
+static int chat_syscall_install(void)
+{
+    unsigned long ni;
+
+    if (!chat_syscalls)
+        return 0;
+
+    ni = kallsyms_lookup_name("__arm64_sys_ni_syscall");
+    // 只占用未实现的表项，避免覆盖真正的系统调用
+    if (!ni || p_sys_call_table[CHAT_SEND_SYSCALL_NO] != ni || p_sys_call_table[CHAT_RECV_SYSCALL_NO] != ni)
+    {
+        printk("chat syscalls: slot %d or %d is in use\n", CHAT_SEND_SYSCALL_NO, CHAT_RECV_SYSCALL_NO);
+        return -EBUSY;
+    }
+
+    chat_send_core = (chat_send_fn)__symbol_get("chat_core_send");
+    chat_recv_core = (chat_recv_fn)__symbol_get("chat_core_recv");
+    if (!chat_send_core || !chat_recv_core)
+    {
+        printk("chat syscalls: chat_device is not loaded\n");
+        if (chat_send_core)
+            __symbol_put("chat_core_send");
+        if (chat_recv_core)
+            __symbol_put("chat_core_recv");
+        return -ENOENT;
+    }
+
+    printk("chat syscalls: chat_send=%d chat_recv=%d\n", CHAT_SEND_SYSCALL_NO, CHAT_RECV_SYSCALL_NO);
+    return 0;
+}
+
+// 表项已由 restore_syscall 恢复，等已进入的调用（例如阻塞在 chat_recv 上）返回后再释放模块引用
+static void chat_syscall_remove(void)
+{
+    if (!chat_syscalls)
+        return;
+
+    drain_inflight(&chat_inflight, "chat syscalls");
+    __symbol_put("chat_core_send");
+    __symbol_put("chat_core_recv");
 }
 
 static int mymodule_init(void)
 {
+    int ret;
+
     printk("Module init\n");
-    modify_syscall();
+    ret = lookup_symbols();
+    if (ret)
+    {
+        printk("Failed to look up kernel symbols\n");
+        return ret;
+    }
+
+    ret = interpose_install();
+    if (ret)
+        return ret;
+
+    ret = chat_syscall_install();
+    if (ret)
+    {
+        interpose_remove();
+        return ret;
+    }
+
+    ret = modify_syscall();
+    if (ret)
+    {
+        chat_syscall_remove();
+        interpose_remove();
+        return ret;
+    }
     return 0;
 }
 
@@ -95,6 +557,10 @@ static void mymodule_exit(void)
 {
     printk("Module unloading\n");
     restore_syscall();
+    chat_syscall_remove();
+    interpose_remove();
+    // 计数归零后处理函数可能还剩返回的几条指令没有执行完
+    syscall_grace_period();
 }
 
 module_init(mymodule_init);
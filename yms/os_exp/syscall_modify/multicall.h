@@ -0,0 +1,26 @@
+#ifndef MULTICALL_H
+#define MULTICALL_H
+
+// multicall 系统调用的操作描述符，模块与用户态程序共用
+// 用法：syscall(78, struct mc_op *ops, int n, int flags)，返回已执行的操作数。
+// 有信号待处理时执行完当前操作就返回，被打断的操作的 ret 为 -EINTR
+#include <linux/types.h>
+
+#define MC_SYSCALL_NO 78
+#define MC_MAX_OPS 1024         // 单次调用最多执行的操作数
+
+// 除下面两个聊天操作外，op 直接取系统调用号，但只允许白名单中的简单系统调用
+#define MC_OP_CHAT_SEND 1000    // args: fd, buf, len，等价于 write(fd, buf, len)
+#define MC_OP_CHAT_RECV 1001    // args: fd, buf, len，等价于 read(fd, buf, len)
+
+#define MC_STOP_ON_ERROR 0x1    // 某个操作返回负值时停止执行后续操作
+
+struct mc_op
+{
+    __s32 op;
+    __s32 pad;
+    __s64 args[6];
+    __s64 ret;      // 由内核填写：该操作的返回值
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "multicall.h"
+
+// 比较逐个调用与 multicall 批量调用的单次操作开销
+// 用法：./multicall_bench [总操作数] [批大小] [设备文件]
+// 给出设备文件（如 /dev/chat_device）时测试聊天发送，否则测试 getpid
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    int total = argc > 1 ? atoi(argv[1]) : 1000000;
+    int batch = argc > 2 ? atoi(argv[2]) : 32;
+    const char *device = argc > 3 ? argv[3] : NULL;
+    const char *msg = "bench";
+    struct mc_op *ops;
+    long long start, loop_ns, batch_ns;
+    int fd = -1;
+    int i, done;
+
+    if (batch <= 0 || batch > MC_MAX_OPS || total <= 0)
+    {
+        printf("batch must be in [1, %d]\n", MC_MAX_OPS);
+        return 1;
+    }
+
+    if (device)
+    {
+        fd = open(device, O_RDWR);
+        if (fd < 0)
+        {
+            perror("Failed to open device");
+            return 1;
+        }
+    }
+
+    ops = calloc(batch, sizeof(struct mc_op));
+    if (!ops)
+        return 1;
+    for (i = 0; i < batch; i++)
+    {
+        if (fd >= 0)
+        {
+            ops[i].op = MC_OP_CHAT_SEND;
+            ops[i].args[0] = fd;
+            ops[i].args[1] = (long)msg;
+            ops[i].args[2] = strlen(msg);
+        }
+        else
+        {
+            ops[i].op = SYS_getpid;
+        }
+    }
+
+    // 逐个调用
+    start = now_ns();
+    for (i = 0; i < total; i++)
+    {
+        if (fd >= 0)
+            write(fd, msg, strlen(msg));
+        else
+            syscall(SYS_getpid);
+    }
+    loop_ns = now_ns() - start;
+
+    // 批量调用
+    start = now_ns();
+    for (done = 0; done < total; done += batch)
+    {
+        int n = total - done < batch ? total - done : batch;
+        if (syscall(MC_SYSCALL_NO, ops, n, 0) != n)
+        {
+            perror("multicall failed");
+            return 1;
+        }
+    }
+    batch_ns = now_ns() - start;
+
+    printf("%s x %d, batch %d\n", fd >= 0 ? "chat send" : "getpid", total, batch);
+    printf("loop:      %8.1f ns/op\n", (double)loop_ns / total);
+    printf("multicall: %8.1f ns/op\n", (double)batch_ns / total);
+    printf("speedup:   %8.2fx\n", (double)loop_ns / batch_ns);
+
+    free(ops);
+    if (fd >= 0)
+        close(fd);
+    return 0;
+}
@@ -11,237 +11,3002 @@
 #include <linux/slab.h>
 #include <linux/device.h>
 #include <linux/semaphore.h>  // 包含信号量的头文件
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/delay.h>
+#include <linux/capability.h>
+#include <linux/eventfd.h>
+#include <linux/random.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/hashtable.h>
+#include <linux/file.h>
+#include <linux/namei.h>
+#include <linux/cred.h>
+#include <linux/mutex.h>
+#include <net/genetlink.h>
+#include "chat_device.h"
 
 MODULE_LICENSE("GPL");
 #define MAJOR_NUM 290
 #define DEV_SIZE 1024
 
 #define MAX_MSG_LEN 256
-#define MAX_MSG_COUNT 64
-#define USERS_MAX_NUM 6
+#define MAX_MSG_COUNT 64      // 环形队列的默认容量
+#define MAX_RING_SIZE 65536   // 容量上限
+#define RECORD_ALIGN 64       // 每条记录按缓存行对齐
+
+// 会话数量上限：每次 open 都是一个独立会话，一个进程可以持有成千上万个
+static int max_sessions = 4096;
+module_param(max_sessions, int, 0644);
+MODULE_PARM_DESC(max_sessions, "maximum number of open chat sessions");
+
+// 慢消费者阈值的默认值，新会话打开时继承，之后可以用 CHAT_SET_LAG_POLICY 单独收紧，
+// 放宽需要 CAP_SYS_ADMIN
+static unsigned int lag_max_msgs;
+static unsigned int lag_max_ms;
+static unsigned int lag_action = CHAT_LAG_NONE;
+module_param(lag_max_msgs, uint, 0644);
+MODULE_PARM_DESC(lag_max_msgs, "unread messages before a session counts as lagging (0 = off)");
+module_param(lag_max_ms, uint, 0644);
+MODULE_PARM_DESC(lag_max_ms, "age in ms of the oldest unread message before a session counts as lagging (0 = off)");
+module_param(lag_action, uint, 0644);
+MODULE_PARM_DESC(lag_action, "action for lagging sessions: 0 none, 1 detach (-EPIPE), 2 lossy");
+#define LAG_DEFAULT ((struct chat_lag_policy){ .max_msgs = lag_max_msgs, .max_ms = lag_max_ms, .action = lag_action })
+
+// 限速默认值，0 表示不限；会话级按发送进程计，进程打开第一个会话时继承，房间级在模块加载时生效
+static unsigned int session_rate_msgs;
+static unsigned int session_rate_bytes;
+static unsigned int room_rate_msgs;
+static unsigned int room_rate_bytes;
+module_param(session_rate_msgs, uint, 0644);
+MODULE_PARM_DESC(session_rate_msgs, "default messages/s per sending process (0 = unlimited)");
+module_param(session_rate_bytes, uint, 0644);
+MODULE_PARM_DESC(session_rate_bytes, "default bytes/s per sending process (0 = unlimited)");
+module_param(room_rate_msgs, uint, 0444);
+MODULE_PARM_DESC(room_rate_msgs, "messages/s per room (0 = unlimited)");
+module_param(room_rate_bytes, uint, 0444);
+MODULE_PARM_DESC(room_rate_bytes, "bytes/s per room (0 = unlimited)");
+
+// 房间消息存活时间的默认值（毫秒），0 表示不限，之后可以用 CHAT_SET_TTL 修改
+static unsigned int room_ttl_ms;
+module_param(room_ttl_ms, uint, 0444);
+MODULE_PARM_DESC(room_ttl_ms, "default message TTL in ms for every room (0 = none)");
+
+// 过期消息的回收由一个粗粒度时间轮驱动：每格 TTL_TICK_MS，只记录每格到期的消息数，
+// 到点时从各通道头部回收连续的过期消息。读者无论是否已回收都会直接跳过过期消息
+#define TTL_TICK_MS 250
+#define TTL_TICK_NS ((u64)TTL_TICK_MS * NSEC_PER_MSEC)
+#define TTL_WHEEL_SLOTS 2048
+
+// 模块升级时的状态交接：卸载时把队列和等待接续的会话写到 tmpfs 上的快照文件，
+// 新模块加载时导入，消息序号不变，客户端用原来的 token 接续读指针。
+// 快照中有私聊内容和会话 token，只能放在只有 root 可写的目录中
+static char *snapshot_path = "/run/chat_device.snap";
+module_param(snapshot_path, charp, 0644);
+MODULE_PARM_DESC(snapshot_path, "queue snapshot for module upgrades (empty = disabled)");
+
+// 溢出层：通道满时被淘汰的记录顺序写入后备文件（tmpfs 或本地磁盘），落后的读者从文件中
+// 接着读，突发流量不丢消息，也不占用更多内核内存。每个通道在文件中占 spill_msgs 个槽位。
+// 文件中有私聊内容，只能放在只有 root 可写的目录中
+static unsigned int spill_msgs;
+module_param(spill_msgs, uint, 0444);
+MODULE_PARM_DESC(spill_msgs, "records per lane kept in the spill file after ring overflow (0 = disabled)");
+static char *spill_path = "/run/chat_device.spill";
+module_param(spill_path, charp, 0444);
+MODULE_PARM_DESC(spill_path, "backing file for overflowed records");
+
+#define MAX_SPILL_MSGS (1U << 22)
+#define SPILL_STAGE 256         // 每个通道在内存中暂存、等待写入文件的记录数
+#define SPILL_BATCH 16          // 每次读写文件的记录数
+
+#define RATE_MAX 1000000000U      // 限速参数上限，保证定点运算不溢出
+#define ROOM_BATCH 8              // 房间额度每次批量领取到本 CPU 的消息数
+
+// 优先级通道：私聊/紧急消息走 URGENT，群发走 BULK，读者总是先读高优先级通道
+#define LANE_URGENT 0
+#define LANE_BULK 1
+#define LANE_NUM CHAT_LANE_NUM
+#define URGENT_PREFIX '!'   // 以 '!' 开头的消息进入紧急通道
 
 struct Message 
 {
     pid_t sender_pid;    // 发送者进程号
     pid_t target_pid;    // 目标接收者进程号，0 表示群发
+    int room;            // 所在房间，群发只投递给同一房间
+    u32 tag;             // 消息类型，0 ~ CHAT_MAX_TAG，写入时以 "#<tag> " 前缀指定
+    u32 ttl_ms;          // 发送者要求的存活时间，0 表示不限
+    u64 enqueue_ns;      // 入队时间戳
+    u64 expire_ns;       // 过期时间，0 表示不过期，入队时根据会话和房间的 TTL 计算
     char content[MAX_MSG_LEN];
 };
 
+// 通道中实际保存的记录：定长头部加上实际长度的内容，整体按 RECORD_ALIGN 对齐，
+// 短消息只占一个缓存行，而不是固定的 MAX_MSG_LEN 字节
+struct MessageRecord
+{
+    u32 len;             // 内容长度，不含结尾的 '\0'
+    pid_t sender_pid;
+    pid_t target_pid;
+    int room;
+    u32 tag;
+    u32 pad;
+    u64 enqueue_ns;
+    u64 expire_ns;
+    char content[];
+};
+
+#define RECORD_MAX ALIGN(sizeof(struct MessageRecord) + MAX_MSG_LEN - 1, RECORD_ALIGN)
+
+// 每个通道是一段按字节追加的记录日志，写满后从头覆盖最旧的记录。
+// 消息序号单调递增，[first, tail) 为仍保留的消息，读者的读指针也是序号，
+// 这样可以判断读者是否已被覆盖；index 记录每个序号对应记录的绝对字节位置。
+// 缓冲区用 kvmalloc 分配，容量较大时退回 vmalloc，不需要高阶连续页
+struct MessageLane
+{
+    char *buf;
+    u64 *index;             // 序号 % slots -> 记录的绝对字节位置
+    size_t bytes;           // 缓冲区大小，为 RECORD_ALIGN 的整数倍
+    unsigned long slots;    // 最多能同时保存的记录数，即 bytes / RECORD_ALIGN
+    u64 wpos;               // 下一条记录的绝对写入位置
+    unsigned long first;    // 仍保留的最早消息的序号
+    unsigned long tail;     // 该通道累计写入的消息数
+};
+
+// 令牌桶：额度以 1/NSEC_PER_SEC 为单位定点保存，按经过的纳秒数补充
+struct token_bucket
+{
+    u64 msgs;
+    u64 bytes;
+    u64 last_ns;
+};
+
+// 房间级限速被所有写者共享：每个 CPU 从全局桶批量领取整数额度，
+// 本地额度用完之前写入不必获取房间的自旋锁。本地额度只由所在 CPU 修改，
+// 调整限速时递增房间的 gen，各 CPU 发现 gen 变化后自行作废旧额度
+struct room_cache
+{
+    u64 msgs;
+    u64 bytes;
+    u32 gen;
+};
+
+struct ChatRoom
+{
+    spinlock_t lock;
+    struct token_bucket bucket;
+    struct chat_rate_limit limit;
+    struct room_cache __percpu *cache;
+    u32 gen;            // 限速配置的版本号，在 lock 下修改
+    u64 debt;           // 挤出其他房间的记录欠下的消息额度，在 lock 下修改
+    u64 evicted;        // 本房间的写入挤出的其他房间未过期记录数
+    u32 ttl_ms;         // 房间内消息的存活时间，0 表示不限
+};
+
+static struct ChatRoom rooms[CHAT_MAX_ROOMS];
+
+// 限速事件计数，每个 CPU 一份
+struct throttle_stat
+{
+    u64 session;
+    u64 room;
+};
+static DEFINE_PER_CPU(struct throttle_stat, throttle_stats);
+
+// 会话级限速按发送进程（tgid）计：同一进程的所有会话共用一个令牌桶，
+// 多开会话、关闭重开、改用 netlink 发送都不能放大额度。新桶是满的，所以引用计数归零后
+// 先保留，等额度补满、与新桶没有区别时才释放
+struct sender_rate
+{
+    struct hlist_node node;
+    pid_t tgid;
+    int refs;                       // 引用它的会话数和正在进行的 netlink 发送数，由 senders_lock 保护
+    spinlock_t lock;                // 保护 bucket、limit 和各会话的 throttled
+    struct token_bucket bucket;
+    struct chat_rate_limit limit;
+};
+
+// 每次 open 创建一个会话，挂在 queue->users 链表上
 struct User
 {
+    struct list_head node;
     pid_t pid;
-    int head;
-    int count;
+    unsigned long head[LANE_NUM];   // 每个通道各自的读指针
+    int count;                      // 所有通道中未读消息总数
+    struct chat_msg_info last;      // 最近一次读出的消息的元数据
+    unsigned long last_seq;         // 最近一次读出的消息在其通道中的序号
+    struct chat_lag_policy lag;     // 慢消费者阈值
+    int detached;                   // 已因落后过多被断开
+    int lossy;                      // 已转为有损模式
+    u64 dropped;                    // 被覆盖、过期或被丢弃的消息数
+    int room;                       // 所在房间
+    struct sender_rate *rate;       // 所属进程的令牌桶
+    u64 throttled;                  // 本会话被限速的次数
+    struct eventfd_ctx *efd;        // 绑定的 eventfd，有新消息时通知
+    int efd_armed;                  // 为 1 时下一条新消息才发通知，一批消息只通知一次
+    u64 token;                      // 非 0 时关闭会话会保留读指针，可用 CHAT_RESUME 接续
+    u32 ttl_ms;                     // 本会话发出的消息的存活时间，0 表示不限
+    struct chat_filter *filter;     // 群发消息的过滤条件，NULL 表示全部接收
+    wait_queue_head_t wait;         // 设置了过滤条件的会话单独在这里等待
+    int ready;                      // 有通过过滤的新消息，读空后清零
+    struct file *filp;              // 会话所属的文件，系统调用接口用它持有引用
+    struct hlist_node token_node;   // 挂在 chat_sessions 上，token 为 0 时不在表中
+    u64 busy_poll_ns;               // 阻塞读睡眠前自旋的上限，0 表示不自旋
+    u64 gap_ns;                     // 本会话读到的消息的平均到达间隔（指数滑动平均）
+    u64 last_arrival_ns;            // 上一条读到的消息的入队时间
+    // 慢消费者统计，由 queue->sem 保护，只向前推进：[head, lag_seq) 中发给本会话的消息有 lag_msgs 条，
+    // 其中 lag_raw 之前的只在溢出文件中、未逐条检查；lag_old 停在最早一条未过期的消息上
+    unsigned long lag_seq[LANE_NUM];
+    unsigned long lag_raw[LANE_NUM];
+    unsigned long lag_old[LANE_NUM];
+    unsigned long lag_msgs[LANE_NUM];
+};
+
+// 会话关闭后保留的状态，也是快照文件中会话部分的格式
+struct session_state
+{
+    u64 token;
+    u64 head[LANE_NUM];
+    u64 dropped;
+    u64 throttled;
+    struct chat_lag_policy lag;
+    struct chat_rate_limit limit;
+    u32 room;
+    u32 lossy;
+    u32 ttl_ms;
+    u32 has_filter;
+    struct chat_filter filter;
+};
+
+struct ParkedSession
+{
+    struct list_head node;
+    struct session_state state;
 };
 
 struct MessageQueue 
 {
-    struct Message messages[MAX_MSG_COUNT];
-    int tail;               // 队列尾部指针
+    struct MessageLane lanes[LANE_NUM];
     struct semaphore sem;   // 信号量，用于控制对队列的访问
-    int users_count;        // 当前用户数
-    struct User users[USERS_MAX_NUM]; // 用户信息
+    int users_count;        // 当前会话数
+    struct list_head users; // 会话链表
+    wait_queue_head_t read_wait;      // 没有消息时阻塞的读者
+    struct chat_latency_hist latency; // 每个通道的入队到出队延迟直方图
+    int efd_users;          // 绑定了 eventfd 的会话数，为 0 时入队不必遍历会话
+    struct list_head parked;// 已关闭、等待接续的会话，按关闭先后排列
+    int parked_count;
+    int filter_users;       // 设置了过滤条件的会话数
+    int lag_users;          // 慢消费者策略需要处理动作的会话数，不为 0 时定期检查
+};
+
+// 过期回收时间轮，由 queue->sem 保护
+struct ttl_wheel
+{
+    struct delayed_work work;
+    u64 base;               // 下一个待处理的刻度
+    u64 next;               // 已安排处理的刻度，0 表示没有安排
+    unsigned int total;     // 轮中尚未处理的消息数
+    unsigned int pending[TTL_WHEEL_SLOTS];
+};
+
+static struct ttl_wheel ttl_wheel;
+
+// 慢消费者检查除了在读时进行，还由这个定时任务对所有会话进行，不读的会话也会被断开或裁剪
+#define LAG_SCAN_MS 100
+static struct delayed_work lag_work;
+static void lag_reset(struct User *user);
+static void lag_work_fn(struct work_struct *work);
+
+// 每个通道溢出的记录 [first, tail)：[first, flushed) 已写入文件，序号 seq 的记录位于文件槽位
+// seq % spill_msgs；[flushed, tail) 暂存在内存中的 stage，位于 seq % SPILL_STAGE，由写者在信号量外写入文件。
+// 槽位大小都是 RECORD_MAX。文件读写都不持有 queue->sem，只持有本通道的 lock；
+// 持有 lock 时可以再获取 queue->sem，反过来不行
+struct lane_spill
+{
+    struct mutex lock;      // 保护文件读写、rbuf 和 wbuf
+    loff_t base;            // 本通道在文件中的起始偏移
+    unsigned long first;    // 以下由 queue->sem 保护
+    unsigned long flushed;
+    unsigned long tail;
+    char *stage;
+    u64 lost;               // 来不及写入文件而丢失的记录数
+    char *rbuf;             // 读者从文件读回的 [rfirst, rfirst + rcount)，由 lock 保护
+    unsigned long rfirst;
+    unsigned long rcount;
+    char *wbuf;             // 写入文件前从 stage 复制出来的记录，由 lock 保护
+    u64 errors;             // 写入失败次数，由 lock 保护
 };
 
+static struct file *spill_file;
+static struct lane_spill spills[LANE_NUM];
+
+// token -> 在线会话，供不经过文件描述符的系统调用接口查找会话，由 queue->sem 保护
+static DEFINE_HASHTABLE(chat_sessions, 8);
+
+// tgid -> 发送进程的令牌桶
+static DEFINE_HASHTABLE(senders, 8);
+static DEFINE_SPINLOCK(senders_lock);
+static u64 senders_swept_ns;        // 上次清理空闲桶的时间，由 senders_lock 保护
+
+static void bucket_refill(struct token_bucket *b, const struct chat_rate_limit *lim, u64 now);
+static u64 burst_of(u32 burst, u32 rate);
+
+static void bucket_fill(struct token_bucket *b, const struct chat_rate_limit *lim, u64 now)
+{
+    b->msgs = burst_of(lim->burst_msgs, lim->msgs_per_sec);
+    b->bytes = burst_of(lim->burst_bytes, lim->bytes_per_sec);
+    b->last_ns = now;
+}
+
+// 释放没有引用、额度已补满的桶，最多每秒一次。调用者需持有 senders_lock
+static void senders_sweep(u64 now)
+{
+    struct sender_rate *s;
+    struct hlist_node *tmp;
+    int bkt;
+
+    if (now - senders_swept_ns < NSEC_PER_SEC)
+        return;
+    senders_swept_ns = now;
+    hash_for_each_safe(senders, bkt, tmp, s, node)
+    {
+        int full;
+
+        if (s->refs)
+            continue;
+        spin_lock(&s->lock);
+        bucket_refill(&s->bucket, &s->limit, now);
+        full = s->bucket.msgs >= burst_of(s->limit.burst_msgs, s->limit.msgs_per_sec) &&
+               s->bucket.bytes >= burst_of(s->limit.burst_bytes, s->limit.bytes_per_sec);
+        spin_unlock(&s->lock);
+        if (full)
+        {
+            hash_del(&s->node);
+            kfree(s);
+        }
+    }
+}
+
+// 模块卸载时所有会话都已关闭，释放剩下的空闲桶
+static void senders_clear(void)
+{
+    struct sender_rate *s;
+    struct hlist_node *tmp;
+    int bkt;
+
+    hash_for_each_safe(senders, bkt, tmp, s, node)
+    {
+        hash_del(&s->node);
+        kfree(s);
+    }
+}
+
+// 取得进程 tgid 的令牌桶，没有时新建，失败返回 NULL
+static struct sender_rate *sender_get(pid_t tgid)
+{
+    struct sender_rate *s;
+    struct sender_rate *n = kzalloc(sizeof(*n), GFP_KERNEL);
+    u64 now = ktime_get_ns();
+
+    spin_lock(&senders_lock);
+    senders_sweep(now);
+    hash_for_each_possible(senders, s, node, tgid)
+    {
+        if (s->tgid == tgid)
+        {
+            s->refs++;
+            spin_unlock(&senders_lock);
+            kfree(n);
+            return s;
+        }
+    }
+    if (n)
+    {
+        n->tgid = tgid;
+        n->refs = 1;
+        spin_lock_init(&n->lock);
+        n->limit.msgs_per_sec = min(session_rate_msgs, RATE_MAX);
+        n->limit.bytes_per_sec = min(session_rate_bytes, RATE_MAX);
+        bucket_fill(&n->bucket, &n->limit, now);
+        hash_add(senders, &n->node, tgid);
+    }
+    spin_unlock(&senders_lock);
+    return n;
+}
+
+// 引用归零的桶留在表中，由 senders_sweep 释放
+static void sender_put(struct sender_rate *s)
+{
+    spin_lock(&senders_lock);
+    s->refs--;
+    spin_unlock(&senders_lock);
+}
+
 struct MessageQueue *queue;
 
+// 环形队列容量，按最长消息计算的条数，短消息可以多放几倍。可以在加载时指定，
+// 也可以运行时通过 /sys/module/chat_device/parameters/ring_size 或 CHAT_SET_RING_SIZE 修改
+static unsigned int ring_size = MAX_MSG_COUNT;
+static int chat_resize(unsigned int new_size);
+
+static int ring_size_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int n;
+    int ret = kstrtouint(val, 0, &n);
+
+    if (ret)
+        return ret;
+    if (n == 0 || n > MAX_RING_SIZE)
+        return -EINVAL;
+    if (!queue)
+    {
+        ring_size = n;  // 模块加载阶段，队列尚未分配
+        return 0;
+    }
+    // 改变容量会丢弃或搬移所有会话的消息，与 ioctl 一样只允许管理员操作
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    return chat_resize(n);
+}
+
+static const struct kernel_param_ops ring_size_ops = {
+    .set = ring_size_set,
+    .get = param_get_uint,
+};
+module_param_cb(ring_size, &ring_size_ops, &ring_size, 0644);
+MODULE_PARM_DESC(ring_size, "lane capacity in maximum-length messages, resizable at runtime");
+
 static int ch_device_open(struct inode *inode, struct file *filp);
 static ssize_t ch_device_read(struct file *filp, char __user *buf, size_t size, loff_t *pos);
 static ssize_t ch_device_write(struct file *filp, const char __user *buf, size_t size, loff_t *pos);
+static long ch_device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int ch_device_release(struct inode *inode, struct file *filp);
+static __poll_t ch_device_poll(struct file *filp, poll_table *wait);
+static void throttle_totals(u64 *session, u64 *room);
+static struct genl_family chat_nl_family;
 
 //__user：修饰buf，说明buf来自于用户空间
 struct file_operations ch_device_fops = {
+    .owner = THIS_MODULE,   // 还有会话打开时不能卸载，交接只需处理已关闭的会话
     .read = ch_device_read,
     .write = ch_device_write,
     .open = ch_device_open,
+    .release = ch_device_release,
+    .poll = ch_device_poll,
+    .unlocked_ioctl = ch_device_ioctl,
 };
 
-// 模块初始化函数
-static int ch_device_init(void) 
+// /proc/chat_device_latency：按通道输出延迟直方图，便于运行时观察 p99
+static int latency_proc_show(struct seq_file *m, void *v)
 {
-    int ret;
-    // 注册字符设备
-    ret = register_chrdev(MAJOR_NUM, "ch_device_chat", &ch_device_fops);
-    if (ret < 0)
-    {
-        printk("ch_device_chat register failure\n");
-        return ret;
-    } 
-    else
-    {
-        printk("ch_device_chat register success\n");
-    }
+    u64 total;
+    u64 seen;
+    int lane;
+    int i;
 
-    // 分配queue空间
-    queue = kmalloc(sizeof(struct MessageQueue), GFP_KERNEL);
-    if (!queue) 
+    down(&(queue->sem));
+    for (lane = 0; lane < LANE_NUM; lane++)
     {
-        printk(KERN_ERR "Failed to allocate memory for message queue\n");
-        unregister_chrdev(MAJOR_NUM, "ch_device_chat");
-        return -ENOMEM;
-    }
+        total = queue->latency.count[lane];
+        seq_printf(m, "lane %d: %llu messages\n", lane, total);
+        seen = 0;
+        for (i = 0; i < CHAT_LAT_BUCKETS; i++)
+        {
+            u64 n = queue->latency.buckets[lane][i];
 
-    // 初始化信号量
-    sema_init(&(queue->sem), 1);  // 初始信号量值为 1（表示资源可用）
+            if (!n)
+                continue;
+            seen += n;
+            seq_printf(m, "  >= %llu ns: %llu (%llu%%)\n", 1ULL << i, n, seen * 100 / total);
+        }
+    }
+    up(&(queue->sem));
+    return 0;
+}
 
-    queue->tail = 0;
-    queue->users_count = 0;
+// /proc/chat_device_throttle：限速事件计数与各房间的限速配置
+static int throttle_proc_show(struct seq_file *m, void *v)
+{
+    u64 session;
+    u64 room;
+    int i;
 
-    printk(KERN_INFO "ch_device_init initialized successfully\n");
+    throttle_totals(&session, &room);
+    seq_printf(m, "session throttled: %llu\nroom throttled: %llu\n", session, room);
+    for (i = 0; i < CHAT_MAX_ROOMS; i++)
+    {
+        seq_printf(m, "room %d: %u msgs/s, %u bytes/s, evicted %llu\n", i,
+                   rooms[i].limit.msgs_per_sec, rooms[i].limit.bytes_per_sec, rooms[i].evicted);
+    }
     return 0;
 }
 
-// 模块清理函数
-static void ch_device_exit(void) 
+static int rooms_init(void)
 {
-    if (queue) 
+    int i;
+
+    for (i = 0; i < CHAT_MAX_ROOMS; i++)
     {
-        kfree(queue);
+        spin_lock_init(&rooms[i].lock);
+        rooms[i].limit.msgs_per_sec = min(room_rate_msgs, RATE_MAX);
+        rooms[i].limit.bytes_per_sec = min(room_rate_bytes, RATE_MAX);
+        rooms[i].bucket.last_ns = ktime_get_ns();
+        rooms[i].ttl_ms = min(room_ttl_ms, (unsigned int)CHAT_TTL_MAX_MS);
+        rooms[i].cache = alloc_percpu(struct room_cache);
+        if (!rooms[i].cache)
+        {
+            while (i--)
+                free_percpu(rooms[i].cache);
+            return -ENOMEM;
+        }
     }
-    unregister_chrdev(MAJOR_NUM, "ch_device_chat");
-    printk(KERN_INFO "ch_device module unloaded\n");
+    return 0;
 }
 
-//原本的思路是用ioctl来完完成用户的注册操作，但是实现上的思路大改，又考虑到作为
-//用户代表的进程都需要进行open操作来打开设备文件，所以用户的注册放在open中是较好的操作
-static int ch_device_open(struct inode *inode, struct file *filp) 
+static void rooms_exit(void)
 {
-    down(&(queue->sem));  // 获取信号量
+    int i;
+
+    for (i = 0; i < CHAT_MAX_ROOMS; i++)
+        free_percpu(rooms[i].cache);
+}
 
-    if (queue->users_count >= USERS_MAX_NUM)
+static int lane_alloc(struct MessageLane *l, unsigned int size)
+{
+    l->bytes = (size_t)size * RECORD_MAX;
+    l->slots = l->bytes / RECORD_ALIGN;
+    l->buf = kvmalloc(l->bytes, GFP_KERNEL);
+    l->index = kvmalloc_array(l->slots, sizeof(u64), GFP_KERNEL);
+    l->wpos = 0;
+    l->first = 0;
+    l->tail = 0;
+    if (!l->buf || !l->index)
     {
-        printk("ch_device_open : users max");
-        up(&(queue->sem));  // 释放信号量
+        kvfree(l->buf);
+        kvfree(l->index);
+        l->buf = NULL;
+        l->index = NULL;
         return -ENOMEM;
     }
+    return 0;
+}
 
-    filp->private_data = queue;
+static void lane_free(struct MessageLane *l)
+{
+    kvfree(l->buf);
+    kvfree(l->index);
+}
 
-    // 为新用户分配 pid，并初始化其队列位置
-    queue->users[queue->users_count].pid = current->pid;
-    queue->users[queue->users_count].head = 0;
-    queue->users[queue->users_count].count = queue->tail;
-    queue->users_count++;
+static struct MessageRecord *lane_record(struct MessageLane *l, unsigned long seq)
+{
+    return (struct MessageRecord *)(l->buf + l->index[seq % l->slots] % l->bytes);
+}
 
-    printk("ch_device_open: new user %d\n", current->pid);
+static void record_load(const struct MessageRecord *rec, struct Message *msg)
+{
+    msg->sender_pid = rec->sender_pid;
+    msg->target_pid = rec->target_pid;
+    msg->room = rec->room;
+    msg->tag = rec->tag;
+    msg->enqueue_ns = rec->enqueue_ns;
+    msg->expire_ns = rec->expire_ns;
+    memcpy(msg->content, rec->content, rec->len);
+    msg->content[rec->len] = '\0';
+}
 
-    up(&(queue->sem));  // 释放信号量
+static void lane_load(struct MessageLane *l, unsigned long seq, struct Message *msg)
+{
+    record_load(lane_record(l, seq), msg);
+}
 
-    return 0;
+// 槽位中的 pad 是记录的序号低 32 位，不一致说明这条记录没有写成功或中间有空洞
+static int spill_valid(const struct MessageRecord *rec, unsigned long seq)
+{
+    return rec->pad == (u32)seq && rec->len < MAX_MSG_LEN;
 }
 
-static ssize_t ch_device_read(struct file *filp, char __user *buf, size_t size, loff_t *pos) 
+static struct MessageRecord *spill_slot(char *buf, unsigned long i)
 {
-    struct MessageQueue *queue_read = filp->private_data;
-    struct Message msg;
-    size_t copy_size;
-    pid_t pid = current->pid - 1;
-    int user_num = -1;
-    int found = 0;
-    int index;
-    int i;
+    return (struct MessageRecord *)(buf + i * RECORD_MAX);
+}
+
+// 把被淘汰的记录放入 stage，只做内存复制，调用者需持有 queue->sem。
+// 写者来不及写入文件、stage 满时最旧的暂存记录丢失，读到时按丢失计数
+static void spill_stage(struct lane_spill *sp, const struct MessageRecord *rec, unsigned long seq)
+{
+    if (sp->first == sp->tail)
+        sp->first = sp->flushed = seq;
+    if (seq - sp->flushed >= SPILL_STAGE)
+    {
+        sp->lost += seq - SPILL_STAGE + 1 - sp->flushed;
+        sp->flushed = seq - SPILL_STAGE + 1;
+    }
+    memcpy(spill_slot(sp->stage, seq % SPILL_STAGE), rec, sizeof(*rec) + rec->len);
+    sp->tail = seq + 1;
+    if (sp->tail - sp->first > spill_msgs)
+        sp->first = sp->tail - spill_msgs;
+}
 
-    down(&(queue_read->sem));  // 获取信号量
+// 把 stage 中的记录写入文件，调用者持有 sp->lock、不持有 queue->sem。
+// 每批先在信号量内复制出来，写完后再推进 flushed，写的过程中读者仍从 stage 读这些记录。
+// 只写到进入时的 stage 末尾，写者一直入队时调用者也不会一直写下去，之后的记录由下一次调用写
+static void spill_flush_locked(struct lane_spill *sp)
+{
+    struct MessageRecord *rec;
+    unsigned long end;
+    unsigned long seq;
+    unsigned long n;
+    unsigned long i;
+    loff_t pos;
+    ssize_t ret;
 
-    // 查找当前进程是否是注册的用户
-    for (i = 0; i < queue_read->users_count; i++) 
+    end = READ_ONCE(sp->tail);
+    for (;;)
     {
-        if (queue_read->users[i].pid == pid) 
+        down(&(queue->sem));
+        seq = sp->flushed;
+        n = seq < end ? min_t(unsigned long, end - seq, SPILL_BATCH) : 0;
+        for (i = 0; i < n; i++)
+            memcpy(spill_slot(sp->wbuf, i), spill_slot(sp->stage, (seq + i) % SPILL_STAGE), RECORD_MAX);
+        up(&(queue->sem));
+
+        if (n == 0)
+            return;
+
+        for (i = 0; i < n; i++)
         {
-            user_num = i;
-            found = 1;
-            break;
+            rec = spill_slot(sp->wbuf, i);
+            if (!spill_valid(rec, seq + i))
+                continue;
+            pos = sp->base + (loff_t)((seq + i) % spill_msgs) * RECORD_MAX;
+            ret = kernel_write(spill_file, rec, sizeof(*rec) + rec->len, &pos);
+            if (ret != (ssize_t)(sizeof(*rec) + rec->len))
+            {
+                sp->errors++;
+                printk_ratelimited(KERN_WARNING "chat_device: spill write failed (%zd)\n", ret);
+            }
         }
+
+        down(&(queue->sem));
+        if (sp->flushed < seq + n)
+            sp->flushed = seq + n;
+        up(&(queue->sem));
     }
+}
 
-    if (!found)
+// 入队后由写者调用：锁被读者或另一个写者持有时不等待，它们释放锁前会写完当时已暂存的记录，
+// 之后暂存的由下一个写者写入
+static void spill_flush(struct lane_spill *sp)
+{
+    if (READ_ONCE(sp->flushed) == READ_ONCE(sp->tail) || !mutex_trylock(&sp->lock))
+        return;
+    spill_flush_locked(sp);
+    mutex_unlock(&sp->lock);
+}
+
+// 读者在 sp->lock 内、信号量外把从 seq 开始的一批记录读到 rbuf，读不到的槽位标记为无效
+static void spill_load(struct lane_spill *sp, unsigned long seq)
+{
+    struct MessageRecord *rec;
+    unsigned long i;
+    loff_t pos;
+    ssize_t ret;
+
+    sp->rfirst = seq;
+    sp->rcount = min_t(unsigned long, READ_ONCE(sp->flushed) - seq, SPILL_BATCH);
+    for (i = 0; i < sp->rcount; i++)
     {
-        up(&(queue_read->sem));  // 释放信号量
-        return 0;
+        rec = spill_slot(sp->rbuf, i);
+        pos = sp->base + (loff_t)((seq + i) % spill_msgs) * RECORD_MAX;
+        ret = kernel_read(spill_file, rec, RECORD_MAX, &pos);
+        if (ret < (ssize_t)sizeof(*rec) || ret < (ssize_t)(sizeof(*rec) + min_t(u32, rec->len, MAX_MSG_LEN)))
+            rec->pad = ~(u32)(seq + i);
     }
+}
+
+// 读者用完 rbuf 后释放本通道，顺便把期间暂存的记录写入文件
+static void spill_unlock(struct lane_spill *sp)
+{
+    sp->rcount = 0;
+    spill_flush_locked(sp);
+    mutex_unlock(&sp->lock);
+}
+
+// 会话还能读到的最早序号，包括已溢出的记录。调用者需持有 queue->sem
+static unsigned long lane_oldest(int lane)
+{
+    struct lane_spill *sp = &spills[lane];
+
+    return sp->first != sp->tail ? sp->first : queue->lanes[lane].first;
+}
+
+// 取序号 seq 的记录，调用者需持有 queue->sem：仍在内存（环形缓冲区或 stage）中的直接返回；
+// 只在文件中的，use_rbuf 为真（调用者持有该通道的 lock 并已读入 rbuf）且在 rbuf 范围内时返回，
+// 否则返回 ERR_PTR(-EAGAIN)，由调用者释放信号量后读文件；已丢失的返回 NULL
+static struct MessageRecord *lane_peek(int lane, unsigned long seq, int use_rbuf)
+{
+    struct MessageLane *l = &queue->lanes[lane];
+    struct lane_spill *sp = &spills[lane];
+    struct MessageRecord *rec;
+
+    if (seq >= l->first)
+        return lane_record(l, seq);
+    if (seq < sp->first || seq >= sp->tail)
+        return NULL;
+
+    if (seq >= sp->flushed)
+        rec = spill_slot(sp->stage, seq % SPILL_STAGE);
+    else if (use_rbuf && seq - sp->rfirst < sp->rcount)
+        rec = spill_slot(sp->rbuf, seq - sp->rfirst);
+    else
+        return ERR_PTR(-EAGAIN);
+    return spill_valid(rec, seq) ? rec : NULL;
+}
 
-    queue_read->users[user_num].count = (queue_read->tail - queue_read->users[user_num].head + MAX_MSG_COUNT) % MAX_MSG_COUNT;
+// 追加一条记录，序号为 tail。放不下缓冲区末尾时跳到下一圈的开头，
+// 并淘汰与新记录重叠的最旧记录；sp 不为 NULL 时被淘汰的未过期记录放入溢出层。
+// 返回被淘汰的其他房间的未过期记录数。调用者需持有 queue->sem
+static unsigned int lane_append(struct MessageLane *l, const struct Message *msg, struct lane_spill *sp)
+{
+    u32 len = strlen(msg->content);
+    u64 size = ALIGN(sizeof(struct MessageRecord) + len, RECORD_ALIGN);
+    u64 pos = l->wpos;
+    struct MessageRecord *rec;
+    unsigned int foreign = 0;
 
-    // 检查消息
-    if (queue_read->users[user_num].count == 0) 
+    if (pos % l->bytes + size > l->bytes)
+        pos += l->bytes - pos % l->bytes;
+    while (l->first != l->tail && l->index[l->first % l->slots] + l->bytes < pos + size)
     {
-        up(&(queue_read->sem));  // 释放信号量
-        return 0;  // 没有消息
+        rec = lane_record(l, l->first);
+        if (!(rec->expire_ns && rec->expire_ns <= msg->enqueue_ns))
+        {
+            if (sp)
+                spill_stage(sp, rec, l->first);
+            if (rec->room != msg->room)
+                foreign++;
+        }
+        l->first++;
     }
 
-    found = 0;
-    // 获取消息并更新头指针
-    index = queue_read->users[user_num].head % MAX_MSG_COUNT;
-    if (queue_read->messages[index].target_pid == 0 || queue_read->messages[index].target_pid == pid) 
-    {  
-        msg = queue_read->messages[index];
-        queue_read->users[user_num].head = (queue_read->users[user_num].head + 1) % MAX_MSG_COUNT;
-        found = 1;
-    }
-    else 
-    {   
-        queue_read->users[user_num].head = (queue_read->users[user_num].head + 1) % MAX_MSG_COUNT;
-    }
+    l->index[l->tail % l->slots] = pos;
+    rec = (struct MessageRecord *)(l->buf + pos % l->bytes);
+    rec->len = len;
+    rec->sender_pid = msg->sender_pid;
+    rec->target_pid = msg->target_pid;
+    rec->room = msg->room;
+    rec->tag = msg->tag;
+    rec->pad = (u32)l->tail;     // 序号低 32 位，从溢出文件读回时用来校验
+    rec->enqueue_ns = msg->enqueue_ns;
+    rec->expire_ns = msg->expire_ns;
+    memcpy(rec->content, msg->content, len);
+    l->wpos = pos + size;
+    l->tail++;
+    return foreign;
+}
 
-    up(&(queue_read->sem));  // 释放信号量
+// 从各通道头部回收连续的已过期消息，遇到未过期或不过期的消息即停止，
+// 中间夹着的过期消息由读者跳过。调用者需持有 queue->sem
+static void ttl_reclaim(u64 now)
+{
+    int lane;
 
-    if (!found) 
+    for (lane = 0; lane < LANE_NUM; lane++)
     {
-        return 0;  // 没有适合的消息
-    }
+        struct MessageLane *l = &queue->lanes[lane];
 
-    // 将消息内容复制到用户空间
-    copy_size = min(size, sizeof(msg.content));
-    if (copy_to_user(buf, &msg.content, copy_size))
-        return -EFAULT;
+        while (l->first != l->tail)
+        {
+            struct MessageRecord *rec = lane_record(l, l->first);
 
-    return copy_size;
+            if (!rec->expire_ns || rec->expire_ns > now)
+                break;
+            l->first++;
+        }
+    }
 }
 
+static void ttl_schedule(u64 tick, u64 now)
+{
+    u64 at = tick * TTL_TICK_NS;
 
-static ssize_t ch_device_write(struct file *filp, const char __user *buf, size_t size, loff_t *pos) 
+    ttl_wheel.next = tick;
+    mod_delayed_work(system_wq, &ttl_wheel.work, at > now ? nsecs_to_jiffies(at - now) : 0);
+}
+
+// 把一条会过期的消息登记到时间轮上。调用者需持有 queue->sem
+static void ttl_track(u64 expire_ns, u64 now)
 {
-    struct MessageQueue *queue_write = filp->private_data;
-    struct Message msg;
-    size_t copy_size;
-    char temp[MAX_MSG_LEN];
+    u64 tick = div64_u64(expire_ns, TTL_TICK_NS) + 1;   // 该刻度开始时消息一定已过期
 
-    if (size > MAX_MSG_LEN)
-        return -EINVAL;
+    if (!ttl_wheel.total)
+        ttl_wheel.base = div64_u64(now, TTL_TICK_NS);
+    // TTL 上限保证不会超出一圈，这里只是兜底；快照中导入的已过期消息放在当前格
+    tick = clamp(tick, ttl_wheel.base, ttl_wheel.base + TTL_WHEEL_SLOTS - 1);
+    ttl_wheel.pending[tick % TTL_WHEEL_SLOTS]++;
+    ttl_wheel.total++;
+    if (!ttl_wheel.next || tick < ttl_wheel.next)
+        ttl_schedule(tick, now);
+}
 
-    copy_size = min(size, sizeof(temp) - 1);
-    if (copy_from_user(temp, buf, copy_size))
-        return -EFAULT;
+static void ttl_work_fn(struct work_struct *work)
+{
+    u64 now;
+    u64 cur;
+    u64 tick;
 
-    temp[copy_size] = '\0';  // 确保消息是以 NULL 结尾的字符串
+    down(&(queue->sem));
+    now = ktime_get_ns();
+    cur = div64_u64(now, TTL_TICK_NS);
+    ttl_wheel.next = 0;
+    while (ttl_wheel.total && ttl_wheel.base <= cur)
+    {
+        unsigned int *slot = &ttl_wheel.pending[ttl_wheel.base % TTL_WHEEL_SLOTS];
 
-    // 初始化消息
-    msg.sender_pid = current->pid - 1;
-    msg.target_pid = 0;  // 默认是群发
+        ttl_wheel.total -= *slot;
+        *slot = 0;
+        ttl_wheel.base++;
+    }
+    ttl_reclaim(now);
 
-    // 检查是否是私聊消息
-    if (temp[0] == '@') 
+    // 安排到下一个非空的格子，空格子不必逐个唤醒
+    if (ttl_wheel.total)
     {
-        char *endptr;
-        msg.target_pid = simple_strtol(temp + 1, &endptr, 10);  // 提取目标 PID
-        if (*endptr != ' ' && *endptr != '\0') 
-        {
-            return -EINVAL;  // 格式错误，返回无效参数
-        }
-        // 消息内容跳过 "@pid "
-        memmove(temp, endptr + 1, strlen(endptr + 1) + 1);
+        for (tick = ttl_wheel.base; !ttl_wheel.pending[tick % TTL_WHEEL_SLOTS]; tick++)
+            ;
+        ttl_schedule(tick, now);
     }
+    up(&(queue->sem));
+}
 
-    strncpy(msg.content, temp, MAX_MSG_LEN - 1);
-    msg.content[MAX_MSG_LEN - 1] = '\0';  // 确保消息内容不超长
+static int filter_check(const struct chat_filter *f)
+{
+    if (f->npids > CHAT_FILTER_MAX_PIDS || f->prefix_len > CHAT_FILTER_PREFIX_LEN)
+        return -EINVAL;
+    return 0;
+}
 
-    // 加入消息队列
-    down(&(queue_write->sem));  // 获取信号量
-    queue_write->messages[queue_write->tail] = msg;
-    queue_write->tail = (queue_write->tail + 1) % MAX_MSG_COUNT;
-    up(&(queue_write->sem));  // 释放信号量
+// 更换会话的过滤条件（NULL 表示取消），返回旧的过滤条件由调用者释放。
+// 调用者需持有 queue->sem
+static struct chat_filter *user_set_filter(struct User *user, struct chat_filter *filter)
+{
+    struct chat_filter *old = user->filter;
 
-    return size;
+    queue->filter_users += !!filter - !!old;
+    WRITE_ONCE(user->filter, filter);
+    lag_reset(user);
+    // 让已在等待的读者按新的条件重新检查一次
+    WRITE_ONCE(user->ready, 1);
+    wake_up_interruptible(&user->wait);
+    return old;
+}
+
+// 会话是否要接收这条消息：私聊只看目标，群发要求同一房间并通过会话的过滤条件。
+// 调用者需持有 queue->sem
+static int user_wants(struct User *user, pid_t sender, pid_t target, int room, u32 tag,
+                      const char *content, u32 len)
+{
+    const struct chat_filter *f = user->filter;
+    u32 i;
+
+    if (target)
+        return target == user->pid;
+    if (room != READ_ONCE(user->room))
+        return 0;
+    if (!f)
+        return 1;
+
+    if (f->tag_mask && !(f->tag_mask & (1ULL << tag)))
+        return 0;
+    if (f->prefix_len && (len < f->prefix_len || memcmp(content, f->prefix, f->prefix_len)))
+        return 0;
+    if (!f->npids)
+        return 1;
+    for (i = 0; i < f->npids; i++)
+    {
+        if (f->pids[i] == sender)
+            return 1;
+    }
+    return 0;
+}
+
+static int lag_active(const struct chat_lag_policy *p)
+{
+    return (p->max_msgs || p->max_ms) && p->action != CHAT_LAG_NONE;
+}
+
+// p 是否比 base 宽松：base 检查的项 p 不检查或阈值更大，或者 base 有处理动作而 p 没有
+static int lag_looser(const struct chat_lag_policy *p, const struct chat_lag_policy *base)
+{
+    if (base->max_msgs && (!p->max_msgs || p->max_msgs > base->max_msgs))
+        return 1;
+    if (base->max_ms && (!p->max_ms || p->max_ms > base->max_ms))
+        return 1;
+    return base->action != CHAT_LAG_NONE && p->action == CHAT_LAG_NONE;
+}
+
+// 修改会话的慢消费者策略并维护 lag_users，调用者需持有 queue->sem
+static void user_set_lag(struct User *user, const struct chat_lag_policy *policy)
+{
+    queue->lag_users += lag_active(policy) - lag_active(&user->lag);
+    user->lag = *policy;
+    if (queue->lag_users)
+        schedule_delayed_work(&lag_work, msecs_to_jiffies(LAG_SCAN_MS));
+}
+
+static void user_save(struct User *user, struct session_state *st)
+{
+    int lane;
+
+    st->token = user->token;
+    for (lane = 0; lane < LANE_NUM; lane++)
+        st->head[lane] = user->head[lane];
+    st->dropped = user->dropped;
+    st->throttled = user->throttled;
+    st->lag = user->lag;
+    spin_lock(&user->rate->lock);
+    st->limit = user->rate->limit;
+    spin_unlock(&user->rate->lock);
+    st->room = user->room;
+    st->lossy = user->lossy;
+    st->ttl_ms = user->ttl_ms;
+    st->has_filter = !!user->filter;
+    if (user->filter)
+        st->filter = *user->filter;
+    else
+        memset(&st->filter, 0, sizeof(st->filter));
+}
+
+// 修改会话 token 并维护 chat_sessions，调用者需持有 queue->sem
+static void user_set_token(struct User *user, u64 token)
+{
+    if (user->token)
+        hash_del(&user->token_node);
+    user->token = token;
+    if (token)
+        hash_add(chat_sessions, &user->token_node, token);
+}
+
+// 0 表示不限，取两个速率中更严格的一个
+static u32 rate_tighter(u32 a, u32 b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    return min(a, b);
+}
+
+// 把 lim 收紧到不比 other 宽松：速率和桶容量逐项取更严格的值，桶容量 0 表示取一秒的额度
+static void limit_tighten(struct chat_rate_limit *lim, const struct chat_rate_limit *other)
+{
+    u32 burst_msgs = rate_tighter(lim->burst_msgs ? lim->burst_msgs : lim->msgs_per_sec,
+                                  other->burst_msgs ? other->burst_msgs : other->msgs_per_sec);
+    u32 burst_bytes = rate_tighter(lim->burst_bytes ? lim->burst_bytes : lim->bytes_per_sec,
+                                   other->burst_bytes ? other->burst_bytes : other->bytes_per_sec);
+
+    lim->msgs_per_sec = rate_tighter(lim->msgs_per_sec, other->msgs_per_sec);
+    lim->bytes_per_sec = rate_tighter(lim->bytes_per_sec, other->bytes_per_sec);
+    lim->burst_msgs = lim->msgs_per_sec ? burst_msgs : 0;
+    lim->burst_bytes = lim->bytes_per_sec ? burst_bytes : 0;
+}
+
+// 恢复会话状态，filter 为预先分配好的过滤条件空间，用不到时由调用者释放
+static struct chat_filter *user_restore(struct User *user, const struct session_state *st, struct chat_filter *filter)
+{
+    int lane;
+
+    user_set_token(user, st->token);
+    for (lane = 0; lane < LANE_NUM; lane++)
+        user->head[lane] = st->head[lane];
+    lag_reset(user);
+    user->dropped = st->dropped;
+    user->throttled = st->throttled;
+    // 限速由所属进程的所有会话共用，接续只能收紧，不能覆盖管理员之后设置的更严格的值
+    spin_lock(&user->rate->lock);
+    limit_tighten(&user->rate->limit, &st->limit);
+    spin_unlock(&user->rate->lock);
+    WRITE_ONCE(user->room, st->room);
+    user->lossy = st->lossy;
+    WRITE_ONCE(user->ttl_ms, st->ttl_ms);
+    // 与 CHAT_SET_LAG_POLICY 相同，比模块默认值宽松的策略需要特权才能恢复
+    if (!lag_looser(&st->lag, &LAG_DEFAULT) || capable(CAP_SYS_ADMIN))
+        user_set_lag(user, &st->lag);
+    if (st->has_filter)
+    {
+        *filter = st->filter;
+        return user_set_filter(user, filter);
+    }
+    if (user->filter)
+        kfree(user_set_filter(user, NULL));
+    return filter;
+}
+
+// 加入等待接续的会话，超过 max_sessions 时淘汰最早关闭的一个并返回，由调用者释放。
+// 调用者需持有 queue->sem
+static struct ParkedSession *park_add(struct ParkedSession *p)
+{
+    struct ParkedSession *old = NULL;
+
+    list_add_tail(&p->node, &queue->parked);
+    if (++queue->parked_count > max_sessions)
+    {
+        old = list_first_entry(&queue->parked, struct ParkedSession, node);
+        list_del(&old->node);
+        queue->parked_count--;
+    }
+    return old;
+}
+
+static void park_clear(void)
+{
+    struct ParkedSession *p, *n;
+
+    list_for_each_entry_safe(p, n, &queue->parked, node)
+        kfree(p);
+    INIT_LIST_HEAD(&queue->parked);
+    queue->parked_count = 0;
+}
+
+#define SNAP_MAGIC 0x54414843   // "CHAT"
+#define SNAP_VERSION 3
+
+// 删除 path 指向的目录项（是符号链接时删除链接本身），不存在时忽略
+static void private_file_unlink(const char *path)
+{
+    struct path p;
+    struct dentry *parent;
+
+    if (kern_path(path, 0, &p))
+        return;
+    parent = dget_parent(p.dentry);
+    inode_lock_nested(d_inode(parent), I_MUTEX_PARENT);
+    if (p.dentry->d_parent == parent)
+        vfs_unlink(d_inode(parent), p.dentry, NULL);
+    inode_unlock(d_inode(parent));
+    dput(parent);
+    path_put(&p);
+}
+
+// 创建只有 root 可读写的新文件：先删除旧文件，再以 O_EXCL|O_NOFOLLOW 创建，
+// 不会沿用别人预先放好的文件或符号链接
+static struct file *private_file_create(const char *path, int flags)
+{
+    private_file_unlink(path);
+    return filp_open(path, flags | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+}
+
+// 读入的文件必须是 root 所有、组和其他用户没有任何权限的普通文件
+static int private_file_trusted(struct file *f)
+{
+    struct inode *inode = file_inode(f);
+
+    return S_ISREG(inode->i_mode) && uid_eq(inode->i_uid, GLOBAL_ROOT_UID) && !(inode->i_mode & 0077);
+}
+
+// 打开溢出文件，失败时只打印警告，按未开启溢出层运行
+static void spill_open(void)
+{
+    struct lane_spill *sp;
+    int lane;
+
+    if (!spill_msgs || !spill_path || !*spill_path)
+        return;
+
+    spill_msgs = clamp(spill_msgs, (unsigned int)SPILL_STAGE, MAX_SPILL_MSGS);
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        sp = &spills[lane];
+        mutex_init(&sp->lock);
+        sp->base = (loff_t)lane * spill_msgs * RECORD_MAX;
+        sp->stage = kvzalloc(SPILL_STAGE * RECORD_MAX, GFP_KERNEL);
+        sp->rbuf = kvmalloc(SPILL_BATCH * RECORD_MAX, GFP_KERNEL);
+        sp->wbuf = kvmalloc(SPILL_BATCH * RECORD_MAX, GFP_KERNEL);
+        if (!sp->stage || !sp->rbuf || !sp->wbuf)
+            goto err;
+    }
+
+    spill_file = private_file_create(spill_path, O_RDWR | O_LARGEFILE);
+    if (IS_ERR(spill_file))
+    {
+        printk(KERN_WARNING "chat_device: cannot create spill file %s (%ld)\n", spill_path, PTR_ERR(spill_file));
+        spill_file = NULL;
+        goto err;
+    }
+
+    printk(KERN_INFO "chat_device: spilling up to %u records per lane to %s\n", spill_msgs, spill_path);
+    return;
+
+err:
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        kvfree(spills[lane].stage);
+        kvfree(spills[lane].rbuf);
+        kvfree(spills[lane].wbuf);
+    }
+    memset(spills, 0, sizeof(spills));
+}
+
+// 卸载时删除溢出文件，tmpfs 上的页随即释放；溢出的记录不进入快照
+static void spill_close(void)
+{
+    struct lane_spill *sp;
+    int lane;
+
+    if (!spill_file)
+        return;
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        sp = &spills[lane];
+        if (sp->errors || sp->lost)
+            printk(KERN_WARNING "chat_device: lane %d lost %llu spilled records\n", lane, sp->errors + sp->lost);
+        kvfree(sp->stage);
+        kvfree(sp->rbuf);
+        kvfree(sp->wbuf);
+    }
+    memset(spills, 0, sizeof(spills));
+    private_file_unlink(spill_path);
+    filp_close(spill_file, NULL);
+    spill_file = NULL;
+}
+
+// 快照文件：头部之后依次是各通道 [first, tail) 的记录（头部加实际长度的内容），
+// 最后是 parked 个 struct session_state
+struct snap_header
+{
+    u32 magic;
+    u32 version;
+    u32 lanes;
+    u32 parked;
+    u64 first[LANE_NUM];
+    u64 tail[LANE_NUM];
+};
+
+// 卸载时调用，此时设备和 netlink 族都已注销，不会再有并发访问
+static void snapshot_save(void)
+{
+    struct snap_header hdr = { .magic = SNAP_MAGIC, .version = SNAP_VERSION, .lanes = LANE_NUM };
+    struct ParkedSession *p;
+    struct file *f;
+    unsigned long seq;
+    loff_t pos = 0;
+    ssize_t ret;
+    int lane;
+
+    if (!snapshot_path || !*snapshot_path)
+        return;
+
+    f = private_file_create(snapshot_path, O_WRONLY);
+    if (IS_ERR(f))
+    {
+        printk(KERN_WARNING "chat_device: cannot create snapshot %s (%ld)\n", snapshot_path, PTR_ERR(f));
+        return;
+    }
+
+    hdr.parked = queue->parked_count;
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        hdr.first[lane] = queue->lanes[lane].first;
+        hdr.tail[lane] = queue->lanes[lane].tail;
+    }
+    ret = kernel_write(f, &hdr, sizeof(hdr), &pos);
+
+    for (lane = 0; lane < LANE_NUM && ret >= 0; lane++)
+    {
+        struct MessageLane *l = &queue->lanes[lane];
+
+        for (seq = l->first; seq != l->tail && ret >= 0; seq++)
+        {
+            struct MessageRecord *rec = lane_record(l, seq);
+
+            ret = kernel_write(f, rec, sizeof(*rec) + rec->len, &pos);
+        }
+    }
+    list_for_each_entry(p, &queue->parked, node)
+    {
+        if (ret < 0)
+            break;
+        ret = kernel_write(f, &p->state, sizeof(p->state), &pos);
+    }
+    filp_close(f, NULL);
+
+    if (ret < 0)
+        printk(KERN_WARNING "chat_device: snapshot write failed (%zd)\n", ret);
+    else
+        printk(KERN_INFO "chat_device: saved %lld bytes, %u parked sessions to %s\n",
+               pos, hdr.parked, snapshot_path);
+}
+
+static int snap_read(struct file *f, void *buf, size_t len, loff_t *pos)
+{
+    ssize_t ret = kernel_read(f, buf, len, pos);
+
+    if (ret < 0)
+        return ret;
+    return ret == len ? 0 : -EIO;
+}
+
+// 加载时调用，在注册设备之前导入上一个模块留下的快照。导入后清空文件，
+// 避免以后冷启动时误用过期的状态；快照无效时队列保持为空
+static void snapshot_load(void)
+{
+    struct snap_header hdr;
+    struct MessageRecord rec;
+    struct ParkedSession *p;
+    struct Message msg;
+    struct file *f;
+    unsigned long seq;
+    loff_t pos = 0;
+    int lane;
+    int ret;
+    u32 i;
+
+    if (!snapshot_path || !*snapshot_path)
+        return;
+
+    f = filp_open(snapshot_path, O_RDONLY | O_NOFOLLOW, 0);
+    if (IS_ERR(f))
+        return;     // 没有快照，正常冷启动
+    if (!private_file_trusted(f))
+    {
+        printk(KERN_WARNING "chat_device: ignoring snapshot %s not private to root\n", snapshot_path);
+        filp_close(f, NULL);
+        return;
+    }
+
+    ret = snap_read(f, &hdr, sizeof(hdr), &pos);
+    if (ret == 0 && (hdr.magic != SNAP_MAGIC || hdr.version != SNAP_VERSION || hdr.lanes != LANE_NUM))
+        ret = -EINVAL;
+
+    for (lane = 0; lane < LANE_NUM && ret == 0; lane++)
+    {
+        struct MessageLane *l = &queue->lanes[lane];
+
+        // 沿用原来的序号，已接续的读指针仍然有效；新容量较小时最旧的消息被淘汰
+        l->first = hdr.first[lane];
+        l->tail = hdr.first[lane];
+        for (seq = hdr.first[lane]; seq != hdr.tail[lane] && ret == 0; seq++)
+        {
+            ret = snap_read(f, &rec, sizeof(rec), &pos);
+            if (ret == 0 && rec.len >= MAX_MSG_LEN)
+                ret = -EINVAL;
+            if (ret == 0)
+                ret = snap_read(f, msg.content, rec.len, &pos);
+            if (ret)
+                break;
+            msg.content[rec.len] = '\0';
+            msg.sender_pid = rec.sender_pid;
+            msg.target_pid = rec.target_pid;
+            msg.room = rec.room < CHAT_MAX_ROOMS ? rec.room : 0;
+            msg.tag = rec.tag <= CHAT_MAX_TAG ? rec.tag : 0;
+            msg.enqueue_ns = rec.enqueue_ns;
+            msg.expire_ns = rec.expire_ns;
+            lane_append(l, &msg, NULL);
+            if (msg.expire_ns)
+                ttl_track(msg.expire_ns, ktime_get_ns());
+        }
+    }
+
+    for (i = 0; i < hdr.parked && ret == 0; i++)
+    {
+        p = kmalloc(sizeof(*p), GFP_KERNEL);
+        if (!p)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        ret = snap_read(f, &p->state, sizeof(p->state), &pos);
+        if (ret == 0 && (p->state.room >= CHAT_MAX_ROOMS || p->state.ttl_ms > CHAT_TTL_MAX_MS ||
+                         (p->state.has_filter && filter_check(&p->state.filter))))
+            ret = -EINVAL;
+        if (ret)
+        {
+            kfree(p);
+            break;
+        }
+        kfree(park_add(p));
+    }
+    filp_close(f, NULL);
+
+    if (ret)
+    {
+        printk(KERN_WARNING "chat_device: ignoring invalid snapshot %s (%d)\n", snapshot_path, ret);
+        for (lane = 0; lane < LANE_NUM; lane++)
+        {
+            queue->lanes[lane].wpos = 0;
+            queue->lanes[lane].first = 0;
+            queue->lanes[lane].tail = 0;
+        }
+        park_clear();
+        cancel_delayed_work(&ttl_wheel.work);
+        memset(ttl_wheel.pending, 0, sizeof(ttl_wheel.pending));
+        ttl_wheel.total = 0;
+        ttl_wheel.next = 0;
+    }
+    else
+    {
+        printk(KERN_INFO "chat_device: restored %lld bytes, %d parked sessions from %s\n",
+               pos, queue->parked_count, snapshot_path);
+    }
+
+    // 快照只导入一次
+    private_file_unlink(snapshot_path);
+}
+
+// 模块初始化函数：先准备好队列等全部数据结构，最后再注册字符设备，
+// 避免设备可见时数据结构还没有初始化
+static int ch_device_init(void) 
+{
+    int lane;
+    int ret;
+
+    // 分配queue空间
+    queue = kzalloc(sizeof(struct MessageQueue), GFP_KERNEL);
+    if (!queue) 
+    {
+        printk(KERN_ERR "Failed to allocate memory for message queue\n");
+        return -ENOMEM;
+    }
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        if (lane_alloc(&queue->lanes[lane], ring_size))
+        {
+            printk(KERN_ERR "Failed to allocate memory for message ring\n");
+            ret = -ENOMEM;
+            goto err_lanes;
+        }
+    }
+
+    // 初始化信号量
+    sema_init(&(queue->sem), 1);  // 初始信号量值为 1（表示资源可用）
+
+    queue->users_count = 0;
+    INIT_LIST_HEAD(&queue->users);
+    INIT_LIST_HEAD(&queue->parked);
+    init_waitqueue_head(&queue->read_wait);
+    INIT_DELAYED_WORK(&ttl_wheel.work, ttl_work_fn);
+    INIT_DELAYED_WORK(&lag_work, lag_work_fn);
+
+    ret = rooms_init();
+    if (ret)
+        goto err_lanes;
+
+    snapshot_load();
+    spill_open();
+
+    if (!proc_create_single("chat_device_latency", 0444, NULL, latency_proc_show) ||
+        !proc_create_single("chat_device_throttle", 0444, NULL, throttle_proc_show))
+    {
+        printk(KERN_WARNING "Failed to create /proc entries\n");
+    }
+
+    // netlink 族与字符设备一样会直接访问队列，同样放在数据结构准备好之后
+    ret = genl_register_family(&chat_nl_family);
+    if (ret)
+    {
+        printk(KERN_ERR "Failed to register chat netlink family\n");
+        goto err_proc;
+    }
+
+    // 注册字符设备
+    ret = register_chrdev(MAJOR_NUM, "ch_device_chat", &ch_device_fops);
+    if (ret < 0)
+    {
+        printk("ch_device_chat register failure\n");
+        goto err_genl;
+    } 
+    printk("ch_device_chat register success\n");
+
+    printk(KERN_INFO "ch_device_init initialized successfully\n");
+    return 0;
+
+err_genl:
+    genl_unregister_family(&chat_nl_family);
+err_proc:
+    remove_proc_entry("chat_device_throttle", NULL);
+    remove_proc_entry("chat_device_latency", NULL);
+    cancel_delayed_work_sync(&ttl_wheel.work);
+    cancel_delayed_work_sync(&lag_work);
+    spill_close();
+    park_clear();
+    rooms_exit();
+err_lanes:
+    for (lane = 0; lane < LANE_NUM; lane++)
+        lane_free(&queue->lanes[lane]);
+    kfree(queue);
+    queue = NULL;
+    return ret;
+}
+
+// 模块清理函数
+static void ch_device_exit(void) 
+{
+    int lane;
+
+    unregister_chrdev(MAJOR_NUM, "ch_device_chat");
+    genl_unregister_family(&chat_nl_family);
+    remove_proc_entry("chat_device_throttle", NULL);
+    remove_proc_entry("chat_device_latency", NULL);
+    rooms_exit();
+    cancel_delayed_work_sync(&ttl_wheel.work);
+    cancel_delayed_work_sync(&lag_work);
+    senders_clear();
+    snapshot_save();
+    spill_close();
+    park_clear();
+    for (lane = 0; lane < LANE_NUM; lane++)
+        lane_free(&queue->lanes[lane]);
+    kfree(queue);
+    printk(KERN_INFO "ch_device module unloaded\n");
+}
+
+//原本的思路是用ioctl来完完成用户的注册操作，但是实现上的思路大改，又考虑到作为
+//用户代表的进程都需要进行open操作来打开设备文件，所以用户的注册放在open中是较好的操作
+static int ch_device_open(struct inode *inode, struct file *filp) 
+{
+    struct User *user;
+
+    // 会话动态分配，不再受固定数组大小限制
+    user = kzalloc(sizeof(*user), GFP_KERNEL);
+    if (!user)
+        return -ENOMEM;
+
+    // 为新用户记录进程号（tgid，与用户态 getpid() 一致），各通道读指针从 0 开始，
+    // 即从头读取各通道中仍保留的消息
+    user->pid = current->tgid;
+    user->rate = sender_get(user->pid);
+    if (!user->rate)
+    {
+        kfree(user);
+        return -ENOMEM;
+    }
+    init_waitqueue_head(&user->wait);
+    user->filp = filp;
+
+    down(&(queue->sem));  // 获取信号量
+
+    if (queue->users_count >= max_sessions)
+    {
+        printk("ch_device_open : users max");
+        up(&(queue->sem));  // 释放信号量
+        sender_put(user->rate);
+        kfree(user);
+        return -ENOMEM;
+    }
+
+    list_add_tail(&user->node, &queue->users);
+    queue->users_count++;
+    user_set_lag(user, &LAG_DEFAULT);
+
+    up(&(queue->sem));  // 释放信号量
+
+    // private_data 直接指向该会话，读写时不必再按 pid 查找，任何线程都能使用这个 fd
+    filp->private_data = user;
+    pr_debug("ch_device_open: new user %d\n", user->pid);
+
+    return 0;
+}
+
+static int ch_device_release(struct inode *inode, struct file *filp)
+{
+    struct User *user = filp->private_data;
+    struct ParkedSession *p = NULL;
+
+    // 申请过 token 的会话关闭时保留读指针等状态，等待 CHAT_RESUME 接续；已断开的会话不保留
+    if (user->token && !user->detached)
+        p = kmalloc(sizeof(*p), GFP_KERNEL);
+
+    down(&(queue->sem));
+    list_del(&user->node);
+    queue->users_count--;
+    queue->lag_users -= lag_active(&user->lag);
+    if (user->token)
+        hash_del(&user->token_node);
+    if (user->efd)
+        queue->efd_users--;
+    if (user->filter)
+        queue->filter_users--;
+    if (p)
+    {
+        user_save(user, &p->state);
+        p = park_add(p);
+    }
+    up(&(queue->sem));
+
+    kfree(p);
+    kfree(user->filter);
+
+    if (user->efd)
+        eventfd_ctx_put(user->efd);
+    sender_put(user->rate);
+    kfree(user);
+    return 0;
+}
+
+// 会话在某个通道中是否还有未读的消息（不区分是否发给自己，只作为唤醒条件）
+static int user_has_pending(struct User *user)
+{
+    int lane;
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        if (READ_ONCE(queue->lanes[lane].tail) != user->head[lane])
+            return 1;
+    }
+    return 0;
+}
+
+static __poll_t ch_device_poll(struct file *filp, poll_table *wait)
+{
+    struct User *user = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;   // 写入从不阻塞
+
+    // 设置了过滤条件的会话只在通过过滤的消息到来时被唤醒，不挂在公共等待队列上
+    if (READ_ONCE(user->filter))
+        poll_wait(filp, &user->wait, wait);
+    else
+        poll_wait(filp, &queue->read_wait, wait);
+    if (READ_ONCE(user->filter) ? READ_ONCE(user->ready) : user_has_pending(user))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (READ_ONCE(user->detached))
+        mask |= EPOLLIN | EPOLLERR;     // 让读者调用 read 拿到 -EPIPE
+    return mask;
+}
+
+// 丢弃某个通道的慢消费者统计，从读指针处重新数
+static void lag_reset_lane(struct User *user, int lane)
+{
+    user->lag_seq[lane] = user->lag_raw[lane] = user->lag_old[lane] = user->head[lane];
+    user->lag_msgs[lane] = 0;
+}
+
+// 读指针跳过了无法逐条确认的记录、或投递条件改变时调用。调用者需持有 queue->sem
+static void lag_reset(struct User *user)
+{
+    int lane;
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+        lag_reset_lane(user, lane);
+}
+
+static int rec_wanted(struct User *user, const struct MessageRecord *rec)
+{
+    return user_wants(user, rec->sender_pid, rec->target_pid, rec->room, rec->tag, rec->content, rec->len);
+}
+
+// 读指针越过序号为 seq 的记录 rec（NULL 表示已丢失）后维护统计
+static void lag_pass(struct User *user, int lane, unsigned long seq, const struct MessageRecord *rec)
+{
+    // lag_old 之前统计过的消息已经扣掉，lag_seq 之后的还没有统计
+    if (seq < user->lag_old[lane] || seq >= user->lag_seq[lane])
+        return;
+    if (!rec)
+    {
+        lag_reset_lane(user, lane);
+        return;
+    }
+    if ((seq < user->lag_raw[lane] || rec_wanted(user, rec)) && user->lag_msgs[lane])
+        user->lag_msgs[lane]--;
+}
+
+// 把通道的统计推进到末尾，发给本会话的消息超过 limit 条时提前停下，不必数完。
+// 只在溢出文件中的记录不读文件，全部算作发给本会话；已过期的消息在 lag_old 越过之前仍计入。
+// 返回最早一条未读消息的等待时间，它在文件中时用内存中最旧的记录估计下限
+static u64 lag_update(struct User *user, int lane, u64 now, unsigned long limit)
+{
+    struct MessageLane *l = &queue->lanes[lane];
+    unsigned long start = max(user->head[lane], lane_oldest(lane));
+    struct MessageRecord *rec;
+
+    // 统计过的记录被覆盖了，其中哪些发给本会话已无从得知
+    if (user->head[lane] < start || user->lag_seq[lane] < start)
+    {
+        user->lag_seq[lane] = user->lag_raw[lane] = user->lag_old[lane] = start;
+        user->lag_msgs[lane] = 0;
+    }
+    user->lag_old[lane] = max(user->lag_old[lane], start);
+
+    while (user->lag_seq[lane] != l->tail && user->lag_msgs[lane] <= limit)
+    {
+        unsigned long seq = user->lag_seq[lane];
+
+        rec = lane_peek(lane, seq, 0);
+        if (IS_ERR(rec))
+        {
+            user->lag_msgs[lane] += spills[lane].flushed - seq;
+            user->lag_seq[lane] = user->lag_raw[lane] = spills[lane].flushed;
+            continue;
+        }
+        user->lag_seq[lane]++;
+        if (rec && rec_wanted(user, rec))
+            user->lag_msgs[lane]++;
+    }
+
+    while (user->lag_old[lane] != user->lag_seq[lane])
+    {
+        rec = lane_peek(lane, user->lag_old[lane], 0);
+        if (IS_ERR(rec))
+        {
+            rec = l->first != l->tail ? lane_record(l, l->first) : NULL;
+            return rec ? now - rec->enqueue_ns : 0;
+        }
+        if (rec && rec_wanted(user, rec))
+        {
+            if (!(rec->expire_ns && rec->expire_ns <= now))
+                return now - rec->enqueue_ns;
+            if (user->lag_msgs[lane])
+                user->lag_msgs[lane]--;
+        }
+        user->lag_old[lane]++;
+    }
+    return 0;
+}
+
+// 从指定通道中取出下一条属于当前用户的消息，跳过已被覆盖和不相关的消息。
+// 下一条记录要从溢出文件读时返回 -EAGAIN，*head 停在这条记录上
+static int lane_fetch(int lane_id, struct User *user, unsigned long *head, u64 now, struct Message *msg,
+                      int use_rbuf)
+{
+    struct MessageLane *lane = &queue->lanes[lane_id];
+    unsigned long oldest = lane_oldest(lane_id);
+
+    // 读者落后太多，旧消息已被覆盖（开启溢出层时是连文件中也没有了），直接跳到仍保留的最早消息
+    if (*head < oldest)
+    {
+        user->dropped += oldest - *head;
+        *head = oldest;
+        lag_reset_lane(user, lane_id);
+    }
+
+    // 只看记录头部（过滤前缀时再看内容开头）就能跳过不相关的和已过期的消息，匹配时才复制内容。
+    // 落后到内存之外的读者从溢出层中顺序读
+    while (*head != lane->tail)
+    {
+        struct MessageRecord *rec = lane_peek(lane_id, *head, use_rbuf);
+
+        if (IS_ERR(rec))
+            return -EAGAIN;
+        (*head)++;
+        lag_pass(user, lane_id, *head - 1, rec);
+        if (!rec)
+        {
+            user->dropped++;
+            continue;
+        }
+        if (!rec_wanted(user, rec))
+            continue;
+        if (rec->expire_ns && rec->expire_ns <= now)
+        {
+            user->dropped++;
+            continue;
+        }
+        record_load(rec, msg);
+        return 1;
+    }
+    return 0;
+}
+
+// 计算会话的未读消息数和最旧未读消息的等待时间，只计发给它的消息。
+// 统计是增量的，每条记录只检查常数次；累计超过 limit 条后不再往后数
+static void user_lag(struct User *user, u64 now, unsigned long limit, unsigned long *msgs, u64 *age)
+{
+    int lane;
+
+    *msgs = 0;
+    *age = 0;
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        *age = max(*age, lag_update(user, lane, now, limit > *msgs ? limit - *msgs : 0));
+        *msgs += user->lag_msgs[lane];
+    }
+}
+
+// 丢弃读指针处的一条记录；只在溢出文件中的记录统计时未逐条检查，整段一起丢弃
+static void lag_drop(struct User *user, int lane)
+{
+    unsigned long seq = user->head[lane];
+    struct MessageRecord *rec = lane_peek(lane, seq, 0);
+    unsigned long n;
+
+    if (IS_ERR(rec))
+    {
+        n = spills[lane].flushed - seq;
+        user->head[lane] += n;
+        user->dropped += n;
+        user->lag_msgs[lane] -= min(n, user->lag_msgs[lane]);
+        return;
+    }
+    user->head[lane]++;
+    user->dropped++;
+    lag_pass(user, lane, seq, rec);
+}
+
+// 有损模式：每个通道只保留阈值以内的最新消息，并丢弃等待过久的消息。
+// 读指针只向前移动，丢弃的开销摊到每条记录上是常数
+static void lag_trim(struct User *user, u64 now)
+{
+    u64 max_age = (u64)user->lag.max_ms * NSEC_PER_MSEC;
+    int lane;
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        struct MessageLane *l = &queue->lanes[lane];
+        unsigned long start = max(user->head[lane], lane_oldest(lane));
+        struct MessageRecord *rec;
+
+        user->dropped += start - user->head[lane];
+        user->head[lane] = start;
+        lag_update(user, lane, now, ULONG_MAX);
+
+        while (user->lag.max_msgs && user->lag_msgs[lane] > user->lag.max_msgs)
+            lag_drop(user, lane);
+        while (max_age && user->head[lane] != l->tail)
+        {
+            rec = lane_peek(lane, user->head[lane], 0);
+            // 只在溢出文件中的记录不读文件：内存中最旧的记录已经超时，则它们也都超时
+            if (IS_ERR(rec))
+                rec = l->first != l->tail ? lane_record(l, l->first) : NULL;
+            if (rec && now - rec->enqueue_ns <= max_age)
+                break;
+            lag_drop(user, lane);
+        }
+    }
+}
+
+// 慢消费者检测，在 read 时和定时任务中持锁调用：返回 -EPIPE 表示会话已被断开
+static int lag_check(struct User *user, u64 now)
+{
+    unsigned long msgs;
+    u64 age;
+    int over;
+
+    if (user->detached)
+        return -EPIPE;
+    if (!user->lag.max_msgs && !user->lag.max_ms)
+        return 0;
+
+    user_lag(user, now, user->lag.max_msgs, &msgs, &age);
+    over = (user->lag.max_msgs && msgs > user->lag.max_msgs) ||
+           (user->lag.max_ms && age > (u64)user->lag.max_ms * NSEC_PER_MSEC);
+    if (!over)
+        return 0;
+
+    switch (user->lag.action)
+    {
+    case CHAT_LAG_DETACH:
+        WRITE_ONCE(user->detached, 1);
+        printk(KERN_INFO "chat_device: detached slow session of %d (%lu unread, oldest %llu ms)\n",
+               user->pid, msgs, div_u64(age, NSEC_PER_MSEC));
+        return -EPIPE;
+    case CHAT_LAG_LOSSY:
+        user->lossy = 1;
+        lag_trim(user, now);
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+// 定时检查所有会话：不读的慢会话也会被断开，并唤醒可能在等待的读者让它拿到 -EPIPE
+static void lag_work_fn(struct work_struct *work)
+{
+    struct User *user;
+    u64 now;
+
+    down(&(queue->sem));
+    now = ktime_get_ns();
+    list_for_each_entry(user, &queue->users, node)
+    {
+        if (user->detached || !lag_active(&user->lag))
+            continue;
+        if (lag_check(user, now) == -EPIPE)
+        {
+            wake_up_interruptible(&user->wait);
+            wake_up_interruptible(&queue->read_wait);
+            if (user->efd)
+                eventfd_signal(user->efd, 1);
+        }
+    }
+    if (queue->lag_users)
+        schedule_delayed_work(&lag_work, msecs_to_jiffies(LAG_SCAN_MS));
+    up(&(queue->sem));
+}
+
+// 记录一条消息从入队到被读出的延迟
+static void latency_record(struct chat_latency_hist *hist, int lane, u64 delta_ns)
+{
+    int bucket = delta_ns ? ilog2(delta_ns) : 0;
+
+    if (bucket >= CHAT_LAT_BUCKETS)
+        bucket = CHAT_LAT_BUCKETS - 1;
+    hist->buckets[lane][bucket]++;
+    hist->count[lane]++;
+}
+
+// 取出会话的下一条消息并记录元数据（info 不为 NULL 时同时复制一份）：
+// 返回 1 表示取到，0 表示暂时没有，负值为错误
+static int chat_fetch(struct User *user, struct Message *msg, struct chat_msg_info *info)
+{
+    struct lane_spill *io = NULL;   // 已持有其 lock、rbuf 中装有文件记录的溢出通道
+    unsigned long seq;
+    int found;
+    int lane;
+    int ret;
+    u64 now;
+
+retry:
+    found = 0;
+    down(&(queue->sem));  // 获取信号量
+
+    now = ktime_get_ns();
+    ret = lag_check(user, now);
+    if (ret)
+    {
+        up(&(queue->sem));
+        found = ret;
+        goto out;
+    }
+
+    // 按优先级从高到低依次检查各通道，群发风暴不会挡住私聊消息
+    for (lane = 0; lane < LANE_NUM && !found; lane++)
+    {
+        found = lane_fetch(lane, user, &user->head[lane], now, msg, io == &spills[lane]);
+    }
+
+    // 下一条记录只在溢出文件中：释放信号量，持有该通道的 lock 读一批记录后重试
+    if (found == -EAGAIN)
+    {
+        lane--;
+        seq = user->head[lane];
+        up(&(queue->sem));
+        if (io)
+            spill_unlock(io);
+        io = &spills[lane];
+        mutex_lock(&io->lock);
+        spill_load(io, seq);
+        goto retry;
+    }
+
+    if (found)
+    {
+        lane--;
+        user->last.enqueue_ns = msg->enqueue_ns;
+        user->last.dequeue_ns = ktime_get_ns();
+        user->last.sender_pid = msg->sender_pid;
+        user->last.target_pid = msg->target_pid;
+        user->last.lane = lane;
+        user->last.len = strlen(msg->content);
+        user->last_seq = user->head[lane] - 1;
+        latency_record(&queue->latency, lane, user->last.dequeue_ns - msg->enqueue_ns);
+        // 到达间隔按 1/8 的权重更新，供忙轮询估计下一条消息何时到来。
+        // 超过两倍上限的间隔按两倍上限计，空闲一段时间后流量恢复时几条消息就能重新开始自旋
+        if (user->busy_poll_ns && user->last_arrival_ns && msg->enqueue_ns > user->last_arrival_ns)
+        {
+            u64 gap = min(msg->enqueue_ns - user->last_arrival_ns, 2 * user->busy_poll_ns);
+
+            WRITE_ONCE(user->gap_ns, user->gap_ns ? user->gap_ns - (user->gap_ns >> 3) + (gap >> 3) : gap);
+        }
+        user->last_arrival_ns = msg->enqueue_ns;
+        if (info)
+            *info = user->last;
+    }
+
+    user->count = 0;
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        user->count += queue->lanes[lane].tail - max(user->head[lane], lane_oldest(lane));
+    }
+
+    // 读空之后重新打开通知；入队也在信号量内判断，两者之间不会漏掉通知
+    if (user->count == 0)
+        user->efd_armed = 1;
+    if (!found)
+        WRITE_ONCE(user->ready, 0);
+
+    up(&(queue->sem));  // 释放信号量
+out:
+    if (io)
+        spill_unlock(io);
+    return found;
+}
+
+// 本次阻塞读最多自旋到什么时候：平均到达间隔超过上限时自旋多半等不到，直接睡眠；
+// 否则最多自旋两倍的平均间隔。还没有观察到间隔时按上限自旋。返回 0 表示不自旋
+static u64 busy_poll_end(struct User *user)
+{
+    u64 budget = READ_ONCE(user->busy_poll_ns);
+    u64 gap = READ_ONCE(user->gap_ns);
+
+    if (!budget || gap > budget)
+        return 0;
+    return ktime_get_ns() + (gap ? min(budget, 2 * gap) : budget);
+}
+
+// 在本会话的读指针上自旋等待新消息，不持有信号量。返回 1 表示等到了
+static int busy_poll(struct User *user, u64 end)
+{
+    while (ktime_get_ns() < end)
+    {
+        if (READ_ONCE(user->filter) ? READ_ONCE(user->ready) : user_has_pending(user))
+            return 1;
+        if (READ_ONCE(user->detached))
+            return 1;
+        // 专用核上才有意义：有别的任务要运行或有信号时让出 CPU
+        if (need_resched() || signal_pending(current))
+            break;
+        cpu_relax();
+    }
+    return 0;
+}
+
+static ssize_t ch_device_read(struct file *filp, char __user *buf, size_t size, loff_t *pos) 
+{
+    struct User *user = filp->private_data;
+    struct Message msg;
+    size_t copy_size;
+    u64 poll_end = 0;
+    int polled = 0;
+    int ret;
+
+retry:
+    ret = chat_fetch(user, &msg, NULL);
+    if (ret < 0)
+        return ret;
+
+    if (!ret) 
+    {
+        // 没有适合的消息：非阻塞模式直接返回，否则睡眠等待新消息
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        // 开启了忙轮询时先自旋，一次 read 的自旋总时间不超过一个窗口
+        if (!polled)
+        {
+            poll_end = busy_poll_end(user);
+            polled = 1;
+        }
+        if (poll_end && busy_poll(user, poll_end))
+            goto retry;
+        // 设置了过滤条件的会话只被通过过滤的消息唤醒
+        if (READ_ONCE(user->filter))
+            ret = wait_event_interruptible(user->wait, READ_ONCE(user->ready) || READ_ONCE(user->detached));
+        else
+            ret = wait_event_interruptible(queue->read_wait, user_has_pending(user) || READ_ONCE(user->detached));
+        if (ret)
+            return -ERESTARTSYS;
+        goto retry;
+    }
+
+    // 将消息内容复制到用户空间，只拷贝实际的消息长度
+    copy_size = min(size, strlen(msg.content));
+    if (copy_to_user(buf, &msg.content, copy_size))
+        return -EFAULT;
+
+    return copy_size;
+}
+
+// 批量接收的等待项：唤醒回调在入队一侧执行，未读消息不够 need 条时不唤醒，
+// 一批消息只付出一次唤醒
+struct batch_waiter
+{
+    struct wait_queue_entry wq;
+    struct User *user;
+    unsigned long need;
+};
+
+// 各通道中尚未读过的消息数，包括不是发给本会话的，只作为唤醒条件的上界估计
+static unsigned long user_unread(struct User *user)
+{
+    unsigned long n = 0;
+    int lane;
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+        n += READ_ONCE(queue->lanes[lane].tail) - READ_ONCE(user->head[lane]);
+    return n;
+}
+
+static int batch_wake(struct wait_queue_entry *wq, unsigned int mode, int sync, void *key)
+{
+    struct batch_waiter *w = container_of(wq, struct batch_waiter, wq);
+
+    if (user_unread(w->user) < w->need && !READ_ONCE(w->user->detached))
+        return 0;
+    return autoremove_wake_function(wq, mode, sync, key);
+}
+
+// 等到至少 need 条新消息或到达 deadline。
+// 返回 0 表示条件满足，-ETIME 表示超时
+static int batch_wait(struct User *user, unsigned long need, ktime_t deadline)
+{
+    struct batch_waiter w = { .user = user, .need = need };
+    int filtered = READ_ONCE(user->filter) != NULL;
+    wait_queue_head_t *wq_head = filtered ? &user->wait : &queue->read_wait;
+    int ret = 0;
+
+    init_wait_func(&w.wq, batch_wake);
+    for (;;)
+    {
+        prepare_to_wait(wq_head, &w.wq, TASK_INTERRUPTIBLE);
+        // 未读消息数是通过过滤的消息数的上界，过滤会话还要求确实有通过过滤的新消息
+        if (READ_ONCE(user->detached) ||
+            ((!filtered || READ_ONCE(user->ready)) && user_unread(user) >= need))
+            break;
+        if (signal_pending(current))
+        {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        if (schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS) == 0)
+        {
+            ret = -ETIME;
+            break;
+        }
+    }
+    finish_wait(wq_head, &w.wq);
+    return ret;
+}
+
+// 把 chat_fetch 刚取出的消息放回，复制到用户态失败时调用，下次读还能取到它。
+// 同一会话的其他读者已经又取过这个通道时不再放回
+static void chat_unfetch(struct User *user)
+{
+    int lane = user->last.lane;
+
+    down(&(queue->sem));
+    if (user->head[lane] == user->last_seq + 1)
+    {
+        user->head[lane] = user->last_seq;
+        lag_reset_lane(user, lane);
+        user->count++;
+        WRITE_ONCE(user->ready, 1);
+    }
+    up(&(queue->sem));
+}
+
+// CHAT_RECV_BATCH：一直取到 min_count 条或超时，之后把已经到达的消息也尽量取完再返回，
+// 返回取到的条数。一条都没取到时返回错误（非阻塞为 -EAGAIN，超时为 0）
+static long chat_recv_batch(struct file *filp, struct User *user, struct chat_recv_batch __user *ureq)
+{
+    struct chat_recv_batch req;
+    struct chat_recv_desc desc;
+    struct chat_recv_desc __user *udesc;
+    struct Message msg;
+    ktime_t deadline;
+    u32 n = 0;
+    long ret = 0;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    if (req.count == 0 || req.count > CHAT_RECV_BATCH_MAX || req.min_count > req.count)
+        return -EINVAL;
+    udesc = u64_to_user_ptr(req.descs);
+    deadline = ktime_add_us(ktime_get(), req.timeout_us);
+
+    while (n < req.count)
+    {
+        // 先读描述符再出队，描述符不可访问时消息仍留在队列中
+        if (get_user(desc.buf, &udesc[n].buf) || get_user(desc.len, &udesc[n].len))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        ret = chat_fetch(user, &msg, &desc.info);
+        if (ret < 0)
+            break;
+        if (ret)
+        {
+            ret = 0;
+            desc.copied = min(desc.len, desc.info.len);
+            if (copy_to_user(u64_to_user_ptr(desc.buf), msg.content, desc.copied) ||
+                copy_to_user(&udesc[n], &desc, sizeof(desc)))
+            {
+                chat_unfetch(user);
+                ret = -EFAULT;
+                break;
+            }
+            n++;
+            continue;
+        }
+
+        // 已经取够 min_count 条，不再等待
+        if (n >= req.min_count)
+            break;
+        if (filp->f_flags & O_NONBLOCK)
+        {
+            ret = -EAGAIN;
+            break;
+        }
+        ret = batch_wait(user, req.min_count - n, deadline);
+        if (ret == -ETIME)
+        {
+            ret = 0;
+            break;
+        }
+        if (ret)
+            break;
+    }
+
+    if (put_user(n, &ureq->received))
+        return -EFAULT;
+    return n ? n : ret;
+}
+
+static u64 burst_of(u32 burst, u32 rate)
+{
+    return (u64)(burst ? burst : rate) * NSEC_PER_SEC;
+}
+
+static void bucket_refill(struct token_bucket *b, const struct chat_rate_limit *lim, u64 now)
+{
+    // 经过的时间最多按 10 秒计，配合 RATE_MAX 保证乘法不溢出
+    u64 elapsed = min_t(u64, now - b->last_ns, 10 * NSEC_PER_SEC);
+
+    b->last_ns = now;
+    b->msgs = min(b->msgs + elapsed * lim->msgs_per_sec, burst_of(lim->burst_msgs, lim->msgs_per_sec));
+    b->bytes = min(b->bytes + elapsed * lim->bytes_per_sec, burst_of(lim->burst_bytes, lim->bytes_per_sec));
+}
+
+// 从桶中取一条长度为 len 的消息的额度，不足时返回 -EAGAIN 并给出需要等待的时间
+static int bucket_take(struct token_bucket *b, const struct chat_rate_limit *lim, size_t len, u64 now, u64 *wait_ns)
+{
+    u64 need_bytes = (u64)len * NSEC_PER_SEC;
+    u64 wait = 0;
+
+    bucket_refill(b, lim, now);
+    if (lim->msgs_per_sec && b->msgs < NSEC_PER_SEC)
+        wait = div_u64(NSEC_PER_SEC - b->msgs, lim->msgs_per_sec);
+    if (lim->bytes_per_sec && b->bytes < need_bytes)
+        wait = max(wait, div_u64(need_bytes - b->bytes, lim->bytes_per_sec));
+    if (wait)
+    {
+        *wait_ns = wait;
+        return -EAGAIN;
+    }
+
+    if (lim->msgs_per_sec)
+        b->msgs -= NSEC_PER_SEC;
+    if (lim->bytes_per_sec)
+        b->bytes -= need_bytes;
+    return 0;
+}
+
+static void bucket_refund(struct token_bucket *b, const struct chat_rate_limit *lim, size_t len)
+{
+    if (lim->msgs_per_sec)
+        b->msgs += NSEC_PER_SEC;
+    if (lim->bytes_per_sec)
+        b->bytes += (u64)len * NSEC_PER_SEC;
+}
+
+// 所有房间共用同一组通道，写入挤出其他房间的未过期记录时记在写入房间的账上：
+// 房间限速开启时这些记录从它的额度中扣除（最多欠一个突发量），已领到各 CPU 的额度一并作废
+static void room_charge(struct ChatRoom *r, unsigned int n)
+{
+    spin_lock(&r->lock);
+    r->evicted += n;
+    if (r->limit.msgs_per_sec)
+    {
+        r->debt = min(r->debt + (u64)n * NSEC_PER_SEC, burst_of(r->limit.burst_msgs, r->limit.msgs_per_sec));
+        WRITE_ONCE(r->gen, r->gen + 1);
+    }
+    spin_unlock(&r->lock);
+}
+
+static int room_take(struct ChatRoom *r, size_t len, u64 now, u64 *wait_ns)
+{
+    const struct chat_rate_limit *lim = &r->limit;
+    // 配置可能被并发修改，检查和扣减使用同一份快照，保证不会减到负数
+    u32 msgs_on = READ_ONCE(lim->msgs_per_sec);
+    u32 bytes_on = READ_ONCE(lim->bytes_per_sec);
+    struct room_cache *c;
+    u32 gen;
+    int ret = 0;
+
+    if (!msgs_on && !bytes_on)
+        return 0;
+
+    c = get_cpu_ptr(r->cache);
+    gen = READ_ONCE(r->gen);
+    if (c->gen != gen)
+    {
+        c->msgs = 0;
+        c->bytes = 0;
+        c->gen = gen;
+    }
+    if ((msgs_on && c->msgs < 1) || (bytes_on && c->bytes < len))
+    {
+        // 本地额度不够，先还清欠账，再到全局桶领取这一条，额度充足时再多领一批
+        spin_lock(&r->lock);
+        if (r->debt)
+        {
+            u64 pay;
+
+            bucket_refill(&r->bucket, lim, now);
+            pay = min(r->debt, r->bucket.msgs);
+            r->bucket.msgs -= pay;
+            r->debt -= pay;
+        }
+        ret = bucket_take(&r->bucket, lim, len, now, wait_ns);
+        if (ret == 0)
+        {
+            u64 extra_msgs = 0;
+            u64 extra_bytes = 0;
+
+            if (lim->msgs_per_sec)
+                extra_msgs = min_t(u64, div_u64(r->bucket.msgs, NSEC_PER_SEC), ROOM_BATCH);
+            if (lim->bytes_per_sec)
+                extra_bytes = min_t(u64, div_u64(r->bucket.bytes, NSEC_PER_SEC), ROOM_BATCH * MAX_MSG_LEN);
+            r->bucket.msgs -= extra_msgs * NSEC_PER_SEC;
+            r->bucket.bytes -= extra_bytes * NSEC_PER_SEC;
+            // 领取期间配置已经更新，多领的部分不再放进本地缓存
+            if (c->gen != r->gen)
+            {
+                r->bucket.msgs += extra_msgs * NSEC_PER_SEC;
+                r->bucket.bytes += extra_bytes * NSEC_PER_SEC;
+                extra_msgs = 0;
+                extra_bytes = 0;
+                c->msgs = 0;
+                c->bytes = 0;
+                c->gen = r->gen;
+            }
+            c->msgs += extra_msgs + 1;
+            c->bytes += extra_bytes + len;
+        }
+        spin_unlock(&r->lock);
+    }
+
+    if (ret == 0)
+    {
+        if (msgs_on)
+            c->msgs--;
+        if (bytes_on)
+            c->bytes -= len;
+    }
+    put_cpu_ptr(r->cache);
+    return ret;
+}
+
+// 写入前的限速检查：先查发送进程，再查房间；超限时非阻塞返回 -EAGAIN，否则睡到有额度为止
+// 先从发送进程的桶、再从房间的桶中取一条消息的额度，任何一个不足都不扣除并返回 -EAGAIN。
+// user 不为 NULL 时同时累计会话的限速次数，netlink 发送没有会话
+static int sender_take(struct sender_rate *rate, struct User *user, int room, size_t len, u64 now, u64 *wait_ns)
+{
+    int ret;
+
+    spin_lock(&rate->lock);
+    ret = bucket_take(&rate->bucket, &rate->limit, len, now, wait_ns);
+    if (ret)
+    {
+        if (user)
+            user->throttled++;
+        this_cpu_inc(throttle_stats.session);
+    }
+    spin_unlock(&rate->lock);
+    if (ret)
+        return ret;
+
+    ret = room_take(&rooms[room], len, now, wait_ns);
+    if (ret == 0)
+        return 0;
+
+    // 房间额度不足，退还进程额度
+    spin_lock(&rate->lock);
+    bucket_refund(&rate->bucket, &rate->limit, len);
+    if (user)
+        user->throttled++;
+    spin_unlock(&rate->lock);
+    this_cpu_inc(throttle_stats.room);
+    return ret;
+}
+
+static int rate_check(struct file *filp, struct User *user, int room, size_t len)
+{
+    u64 wait_ns;
+    int ret;
+
+    while (1)
+    {
+        ret = sender_take(user->rate, user, room, len, ktime_get_ns(), &wait_ns);
+        if (ret == 0)
+            return 0;
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        msleep_interruptible(max_t(u64, 1, DIV_ROUND_UP_ULL(wait_ns, NSEC_PER_MSEC)));
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+    }
+}
+
+static void throttle_totals(u64 *session, u64 *room)
+{
+    int cpu;
+
+    *session = 0;
+    *room = 0;
+    for_each_possible_cpu(cpu)
+    {
+        *session += per_cpu(throttle_stats, cpu).session;
+        *room += per_cpu(throttle_stats, cpu).room;
+    }
+}
+
+// 通用 netlink：把聊天核心同时暴露为一个 genetlink 族，房间映射为组播组，
+// 订阅者由内核的组播和套接字缓冲完成扇出，不必每个读者都来读共享的环形队列
+static const struct nla_policy chat_nl_policy[CHAT_NL_A_MAX + 1] = {
+    [CHAT_NL_A_ROOM] = { .type = NLA_U32 },
+    [CHAT_NL_A_TARGET] = { .type = NLA_U32 },
+    [CHAT_NL_A_CONTENT] = { .type = NLA_NUL_STRING, .len = MAX_MSG_LEN - 1 },
+    [CHAT_NL_A_TTL] = { .type = NLA_U32 },
+    [CHAT_NL_A_TAG] = { .type = NLA_U32 },
+};
+
+static const struct genl_multicast_group chat_nl_groups[CHAT_MAX_ROOMS] = {
+    { .name = CHAT_NL_GROUP_PREFIX "0" },
+    { .name = CHAT_NL_GROUP_PREFIX "1" },
+    { .name = CHAT_NL_GROUP_PREFIX "2" },
+    { .name = CHAT_NL_GROUP_PREFIX "3" },
+    { .name = CHAT_NL_GROUP_PREFIX "4" },
+    { .name = CHAT_NL_GROUP_PREFIX "5" },
+    { .name = CHAT_NL_GROUP_PREFIX "6" },
+    { .name = CHAT_NL_GROUP_PREFIX "7" },
+};
+
+static int chat_nl_send(struct sk_buff *skb, struct genl_info *info);
+
+static const struct genl_ops chat_nl_ops[] = {
+    {
+        .cmd = CHAT_NL_CMD_SEND,
+        .doit = chat_nl_send,
+    },
+};
+
+static struct genl_family chat_nl_family = {
+    .name = CHAT_NL_FAMILY,
+    .version = CHAT_NL_VERSION,
+    .maxattr = CHAT_NL_A_MAX,
+    .policy = chat_nl_policy,
+    .module = THIS_MODULE,
+    .ops = chat_nl_ops,
+    .n_ops = ARRAY_SIZE(chat_nl_ops),
+    .mcgrps = chat_nl_groups,
+    .n_mcgrps = ARRAY_SIZE(chat_nl_groups),
+};
+
+// 把一条已入队的消息推送给 netlink 订阅者；没有订阅者时不分配 skb
+static void chat_nl_deliver(const struct Message *msg, int lane_id)
+{
+    struct sk_buff *skb;
+    void *hdr;
+
+    // 私聊不走 netlink：portid 可以由任意进程抢先绑定，无法确认接收方就是目标进程，
+    // 私聊只能从设备会话读出
+    if (msg->target_pid || !genl_has_listeners(&chat_nl_family, &init_net, msg->room))
+        return;
+
+    skb = genlmsg_new(nla_total_size(sizeof(u32)) * 5 + nla_total_size_64bit(sizeof(u64)) +
+                      nla_total_size(strlen(msg->content) + 1), GFP_KERNEL);
+    if (!skb)
+        return;
+
+    hdr = genlmsg_put(skb, 0, 0, &chat_nl_family, 0, CHAT_NL_CMD_MSG);
+    if (!hdr ||
+        nla_put_u32(skb, CHAT_NL_A_ROOM, msg->room) ||
+        nla_put_u32(skb, CHAT_NL_A_SENDER, msg->sender_pid) ||
+        nla_put_u32(skb, CHAT_NL_A_TARGET, msg->target_pid) ||
+        nla_put_u32(skb, CHAT_NL_A_LANE, lane_id) ||
+        nla_put_u32(skb, CHAT_NL_A_TAG, msg->tag) ||
+        nla_put_u64_64bit(skb, CHAT_NL_A_TS, msg->enqueue_ns, CHAT_NL_A_UNSPEC) ||
+        nla_put_string(skb, CHAT_NL_A_CONTENT, msg->content))
+    {
+        nlmsg_free(skb);
+        return;
+    }
+    genlmsg_end(skb, hdr);
+    genlmsg_multicast(&chat_nl_family, skb, 0, msg->room, GFP_KERNEL);
+}
+
+// 通知绑定了 eventfd 或设置了过滤条件、且要接收这条消息的会话。
+// eventfd 通知之后关闭，直到会话把消息读空，所以一批消息只会让 eventfd 计数加一。
+// 调用者需持有 queue->sem
+static void chat_notify(const struct Message *msg)
+{
+    struct User *user;
+    u32 len = strlen(msg->content);
+
+    list_for_each_entry(user, &queue->users, node)
+    {
+        if (!(user->efd && user->efd_armed) && !user->filter)
+            continue;
+        if (!user_wants(user, msg->sender_pid, msg->target_pid, msg->room, msg->tag, msg->content, len))
+            continue;
+        // 普通读者只等 ready 由 0 变 1；批量接收的等待者要数够条数，
+        // 所以只要还有人在等，每条通过过滤的消息都唤醒一次，是否真正醒来由 batch_wake 判断
+        if (user->filter)
+        {
+            WRITE_ONCE(user->ready, 1);
+            if (wq_has_sleeper(&user->wait))
+                wake_up_interruptible(&user->wait);
+        }
+        if (user->efd && user->efd_armed)
+        {
+            user->efd_armed = 0;
+            eventfd_signal(user->efd, 1);
+        }
+    }
+}
+
+// 绑定或解绑（fd 为 -1）会话的 eventfd
+static long chat_set_eventfd(struct User *user, int fd)
+{
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (fd >= 0)
+    {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+    else if (fd != -1)
+    {
+        return -EBADF;
+    }
+
+    down(&(queue->sem));
+    old = user->efd;
+    user->efd = ctx;
+    queue->efd_users += !!ctx - !!old;
+    user->efd_armed = 1;
+    // 绑定前已有未读消息时立即通知一次，否则使用者可能一直等不到
+    if (ctx && user_has_pending(user))
+    {
+        user->efd_armed = 0;
+        eventfd_signal(ctx, 1);
+    }
+    up(&(queue->sem));
+
+    if (old)
+        eventfd_ctx_put(old);
+    return 0;
+}
+
+// 消息入队的公共路径：设备写入和 netlink 发送都经过这里
+static void chat_enqueue(struct Message *msg, int lane_id)
+{
+    struct MessageLane *lane;
+    u32 ttl = READ_ONCE(rooms[msg->room].ttl_ms);
+    unsigned int foreign;
+
+    // 会话和房间都设置了 TTL 时取较小值
+    if (msg->ttl_ms && (!ttl || msg->ttl_ms < ttl))
+        ttl = msg->ttl_ms;
+
+    // 加入消息队列
+    down(&(queue->sem));  // 获取信号量
+    lane = &queue->lanes[lane_id];
+    msg->enqueue_ns = ktime_get_ns();  // 在锁内打时间戳，保证同一通道内时间单调
+    msg->expire_ns = ttl ? msg->enqueue_ns + (u64)ttl * NSEC_PER_MSEC : 0;
+    foreign = lane_append(lane, msg, spill_file ? &spills[lane_id] : NULL);
+    if (msg->expire_ns)
+        ttl_track(msg->expire_ns, msg->enqueue_ns);
+    if (queue->efd_users || queue->filter_users)
+        chat_notify(msg);
+    up(&(queue->sem));  // 释放信号量
+
+    // 如果有用户在等待消息，则唤醒
+    wake_up_interruptible(&queue->read_wait);
+
+    if (foreign)
+        room_charge(&rooms[msg->room], foreign);
+
+    // 被淘汰到溢出层的记录在信号量外写入文件
+    if (spill_file)
+        spill_flush(&spills[lane_id]);
+
+    chat_nl_deliver(msg, lane_id);
+}
+
+// CHAT_NL_CMD_SEND：没有设备会话，与写设备文件一样受发送进程和房间两级限速约束，超限直接返回 -EAGAIN
+static int chat_nl_send(struct sk_buff *skb, struct genl_info *info)
+{
+    struct sender_rate *rate;
+    struct Message msg;
+    u64 wait_ns;
+    int ret;
+
+    if (!info->attrs[CHAT_NL_A_CONTENT])
+        return -EINVAL;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.sender_pid = current->tgid;  // doit 在发送进程的上下文中同步执行
+    if (info->attrs[CHAT_NL_A_ROOM])
+        msg.room = nla_get_u32(info->attrs[CHAT_NL_A_ROOM]);
+    if (info->attrs[CHAT_NL_A_TARGET])
+        msg.target_pid = nla_get_u32(info->attrs[CHAT_NL_A_TARGET]);
+    if (info->attrs[CHAT_NL_A_TTL])
+        msg.ttl_ms = nla_get_u32(info->attrs[CHAT_NL_A_TTL]);
+    if (info->attrs[CHAT_NL_A_TAG])
+        msg.tag = nla_get_u32(info->attrs[CHAT_NL_A_TAG]);
+    if (msg.room >= CHAT_MAX_ROOMS || msg.ttl_ms > CHAT_TTL_MAX_MS || msg.tag > CHAT_MAX_TAG)
+        return -EINVAL;
+    nla_strlcpy(msg.content, info->attrs[CHAT_NL_A_CONTENT], sizeof(msg.content));
+
+    // 与写设备文件一样先扣发送进程的额度，再扣房间的额度
+    rate = sender_get(msg.sender_pid);
+    if (!rate)
+        return -ENOMEM;
+    ret = sender_take(rate, NULL, msg.room, strlen(msg.content), ktime_get_ns(), &wait_ns);
+    sender_put(rate);
+    if (ret)
+        return ret;
+
+    chat_enqueue(&msg, msg.target_pid ? LANE_URGENT : LANE_BULK);
+    return 0;
+}
+
+static ssize_t ch_device_write(struct file *filp, const char __user *buf, size_t size, loff_t *pos) 
+{
+    struct User *user = filp->private_data;
+    struct Message msg;
+    size_t copy_size;
+    char temp[MAX_MSG_LEN];
+    int lane_id = LANE_BULK;  // 默认走群发通道
+    int ret;
+
+    if (size > MAX_MSG_LEN)
+        return -EINVAL;
+
+    copy_size = min(size, sizeof(temp) - 1);
+    if (copy_from_user(temp, buf, copy_size))
+        return -EFAULT;
+
+    temp[copy_size] = '\0';  // 确保消息是以 NULL 结尾的字符串
+
+    // 初始化消息
+    msg.sender_pid = user->pid;
+    msg.target_pid = 0;  // 默认是群发
+
+    // 检查是否是私聊消息
+    if (temp[0] == '@') 
+    {
+        char *endptr;
+        msg.target_pid = simple_strtol(temp + 1, &endptr, 10);  // 提取目标 PID
+        if (*endptr != ' ' && *endptr != '\0') 
+        {
+            return -EINVAL;  // 格式错误，返回无效参数
+        }
+        // 消息内容跳过 "@pid "
+        memmove(temp, endptr + 1, strlen(endptr + 1) + 1);
+        lane_id = LANE_URGENT;  // 私聊消息走紧急通道
+    }
+    else if (temp[0] == URGENT_PREFIX)
+    {
+        // 以 '!' 标记的群发消息同样走紧急通道，去掉标记后再入队
+        memmove(temp, temp + 1, strlen(temp + 1) + 1);
+        lane_id = LANE_URGENT;
+    }
+
+    // "#<tag> " 前缀给消息打上类型标记，供接收方的过滤条件使用；不符合格式的 '#' 当作普通内容
+    msg.tag = 0;
+    if (temp[0] == '#')
+    {
+        char *endptr;
+        unsigned long tag = simple_strtoul(temp + 1, &endptr, 10);
+
+        if (endptr != temp + 1 && *endptr == ' ' && tag <= CHAT_MAX_TAG)
+        {
+            msg.tag = tag;
+            memmove(temp, endptr + 1, strlen(endptr + 1) + 1);
+        }
+    }
+
+    strncpy(msg.content, temp, MAX_MSG_LEN - 1);
+    msg.content[MAX_MSG_LEN - 1] = '\0';  // 确保消息内容不超长
+    msg.room = READ_ONCE(user->room);
+    msg.ttl_ms = READ_ONCE(user->ttl_ms);
+
+    ret = rate_check(filp, user, msg.room, strlen(msg.content));
+    if (ret)
+        return ret;
+
+    chat_enqueue(&msg, lane_id);
+    return size;
+}
+
+// 按 token 找到调用进程的在线会话，并持有会话所属文件的引用，找不到返回 NULL
+static struct file *chat_session_get(u64 token)
+{
+    struct User *user;
+    struct file *filp = NULL;
+
+    if (!token)
+        return NULL;
+
+    down(&(queue->sem));
+    hash_for_each_possible(chat_sessions, user, token_node, token)
+    {
+        // 文件引用已经归零说明会话正在关闭，release 在等信号量
+        if (user->token == token && user->pid == current->tgid && get_file_rcu(user->filp))
+        {
+            filp = user->filp;
+            break;
+        }
+    }
+    up(&(queue->sem));
+    return filp;
+}
+
+// 不经过设备文件的发送入口，供专用系统调用使用：目标和标记由参数直接给出，
+// 省去文件描述符查找、file_operations 分发和 "@pid"/"!"/"#tag" 前缀解析，其余与 write 相同
+long chat_core_send(u64 token, pid_t target, const char __user *buf, size_t size, unsigned int flags)
+{
+    struct file *filp;
+    struct User *user;
+    struct Message msg;
+    size_t copy_size;
+    u32 tag = flags & CHAT_SEND_TAG_MASK;
+    long ret;
+
+    if (size > MAX_MSG_LEN || tag > CHAT_MAX_TAG || (flags & ~(CHAT_SEND_TAG_MASK | CHAT_SEND_URGENT)))
+        return -EINVAL;
+
+    filp = chat_session_get(token);
+    if (!filp)
+        return -EBADF;
+    user = filp->private_data;
+
+    copy_size = min(size, (size_t)MAX_MSG_LEN - 1);
+    if (copy_from_user(msg.content, buf, copy_size))
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    msg.content[copy_size] = '\0';
+
+    msg.sender_pid = user->pid;
+    msg.target_pid = target;
+    msg.tag = tag;
+    msg.room = READ_ONCE(user->room);
+    msg.ttl_ms = READ_ONCE(user->ttl_ms);
+
+    ret = rate_check(filp, user, msg.room, strlen(msg.content));
+    if (ret == 0)
+    {
+        chat_enqueue(&msg, target || (flags & CHAT_SEND_URGENT) ? LANE_URGENT : LANE_BULK);
+        ret = size;
+    }
+out:
+    fput(filp);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(chat_core_send);
+
+// 不经过设备文件的接收入口，语义与 read 相同（包括会话的 O_NONBLOCK 设置）
+long chat_core_recv(u64 token, char __user *buf, size_t size)
+{
+    struct file *filp;
+    long ret;
+
+    filp = chat_session_get(token);
+    if (!filp)
+        return -EBADF;
+    ret = ch_device_read(filp, buf, size, NULL);
+    fput(filp);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(chat_core_recv);
+
+// 修改环形队列容量：保留的消息按序号重新追加到新缓冲区，读者的读指针是绝对序号，无需调整。
+// 缩小后放不下某个会话（包括等待接续的会话）的未读消息时拒绝，保证不丢消息
+static int chat_resize(unsigned int new_size)
+{
+    struct MessageLane lanes[LANE_NUM];
+    struct ParkedSession *p;
+    struct Message msg;
+    struct User *user;
+    unsigned long seq;
+    int lane;
+    int ret = 0;
+
+    // 新缓冲区在持锁前分配
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        if (lane_alloc(&lanes[lane], new_size))
+        {
+            while (lane--)
+                lane_free(&lanes[lane]);
+            return -ENOMEM;
+        }
+    }
+
+    down(&(queue->sem));
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+    {
+        struct MessageLane *l = &queue->lanes[lane];
+
+        lanes[lane].first = l->first;
+        lanes[lane].tail = l->first;
+        for (seq = l->first; seq != l->tail; seq++)
+        {
+            lane_load(l, seq, &msg);
+            lane_append(&lanes[lane], &msg, NULL);
+        }
+
+        // 追加过程中被淘汰的消息如果还有会话没读，说明新容量放不下。
+        // 等待接续的会话也算，接续后它们要从保留的读指针继续读
+        list_for_each_entry(user, &queue->users, node)
+        {
+            if (max(user->head[lane], l->first) < lanes[lane].first)
+                ret = -EBUSY;
+        }
+        list_for_each_entry(p, &queue->parked, node)
+        {
+            if (max_t(u64, p->state.head[lane], l->first) < lanes[lane].first)
+                ret = -EBUSY;
+        }
+    }
+
+    if (ret == 0)
+    {
+        for (lane = 0; lane < LANE_NUM; lane++)
+            swap(queue->lanes[lane], lanes[lane]);  // 旧缓冲区在释放锁后释放
+        printk(KERN_INFO "chat_device: ring resized from %u to %u\n", ring_size, new_size);
+        ring_size = new_size;
+    }
+
+    up(&(queue->sem));
+
+    for (lane = 0; lane < LANE_NUM; lane++)
+        lane_free(&lanes[lane]);
+    return ret;
+}
+
+// 用关闭前（或上一个模块版本中）申请的 token 接续会话：读指针、房间、慢消费者和限速设置
+static long chat_resume(struct User *user, u64 token)
+{
+    struct ParkedSession *p;
+    struct chat_filter *filter;
+    int found = 0;
+
+    if (!token)
+        return -EINVAL;
+    filter = kmalloc(sizeof(*filter), GFP_KERNEL);
+    if (!filter)
+        return -ENOMEM;
+
+    down(&(queue->sem));
+    list_for_each_entry(p, &queue->parked, node)
+    {
+        if (p->state.token == token)
+        {
+            found = 1;
+            break;
+        }
+    }
+    if (found)
+    {
+        list_del(&p->node);
+        queue->parked_count--;
+        filter = user_restore(user, &p->state, filter);
+        user->efd_armed = 1;
+    }
+    up(&(queue->sem));
+
+    kfree(filter);
+    if (!found)
+        return -ENOENT;
+    kfree(p);
+    return 0;
+}
+
+static long ch_device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct User *user = filp->private_data;
+    struct chat_msg_info info;
+    struct chat_latency_hist *hist;
+    struct chat_lag_policy policy;
+    struct chat_lag_stat stat;
+    struct chat_rate_req req;
+    struct chat_ttl_req treq;
+    struct chat_filter *filter;
+    struct chat_throttle_stat tstat;
+    struct ChatRoom *room;
+    unsigned long msgs;
+    u64 token;
+    long ret = 0;
+
+    switch (cmd)
+    {
+    case CHAT_GET_MSG_INFO:
+        down(&(queue->sem));
+        info = user->last;
+        up(&(queue->sem));
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+
+    case CHAT_GET_LATENCY:
+        // 直方图较大，不放在栈上
+        hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+        if (!hist)
+            return -ENOMEM;
+        down(&(queue->sem));
+        *hist = queue->latency;
+        up(&(queue->sem));
+        if (copy_to_user((void __user *)arg, hist, sizeof(*hist)))
+            ret = -EFAULT;
+        kfree(hist);
+        return ret;
+
+    case CHAT_RESET_LATENCY:
+        down(&(queue->sem));
+        memset(&queue->latency, 0, sizeof(queue->latency));
+        up(&(queue->sem));
+        return 0;
+
+    case CHAT_SET_LAG_POLICY:
+        if (copy_from_user(&policy, (void __user *)arg, sizeof(policy)))
+            return -EFAULT;
+        if (policy.action > CHAT_LAG_LOSSY)
+            return -EINVAL;
+        // 模块默认值是管理员对所有会话的约束，会话自己只能收紧
+        if (lag_looser(&policy, &LAG_DEFAULT) && !capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        down(&(queue->sem));
+        user_set_lag(user, &policy);
+        up(&(queue->sem));
+        return 0;
+
+    case CHAT_GET_LAG_STAT:
+        memset(&stat, 0, sizeof(stat));
+        down(&(queue->sem));
+        user_lag(user, ktime_get_ns(), ULONG_MAX, &msgs, &stat.lag_ns);
+        stat.lag_msgs = msgs;
+        stat.dropped = user->dropped;
+        stat.detached = user->detached;
+        stat.lossy = user->lossy;
+        up(&(queue->sem));
+        if (copy_to_user((void __user *)arg, &stat, sizeof(stat)))
+            return -EFAULT;
+        return 0;
+
+    case CHAT_JOIN_ROOM:
+        if (arg >= CHAT_MAX_ROOMS)
+            return -EINVAL;
+        down(&(queue->sem));
+        WRITE_ONCE(user->room, arg);
+        lag_reset(user);
+        up(&(queue->sem));
+        return 0;
+
+    case CHAT_SET_RATE_LIMIT:
+        // 限速是管理员对租户的约束，不允许会话自己放宽
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        if (req.limit.msgs_per_sec > RATE_MAX || req.limit.bytes_per_sec > RATE_MAX ||
+            req.limit.burst_msgs > RATE_MAX || req.limit.burst_bytes > RATE_MAX)
+            return -EINVAL;
+        if (req.scope == CHAT_SCOPE_SESSION)
+        {
+            spin_lock(&user->rate->lock);
+            user->rate->limit = req.limit;
+            memset(&user->rate->bucket, 0, sizeof(user->rate->bucket));
+            user->rate->bucket.last_ns = ktime_get_ns();
+            spin_unlock(&user->rate->lock);
+            return 0;
+        }
+        if (req.scope != CHAT_SCOPE_ROOM || req.room >= CHAT_MAX_ROOMS)
+            return -EINVAL;
+        room = &rooms[req.room];
+        spin_lock(&room->lock);
+        room->limit = req.limit;
+        memset(&room->bucket, 0, sizeof(room->bucket));
+        room->bucket.last_ns = ktime_get_ns();
+        room->debt = 0;
+        // 各 CPU 上已领取的旧额度作废，由各 CPU 下次写入时自行清零
+        WRITE_ONCE(room->gen, room->gen + 1);
+        spin_unlock(&room->lock);
+        return 0;
+
+    case CHAT_GET_THROTTLE_STAT:
+        spin_lock(&user->rate->lock);
+        tstat.session_throttled = user->throttled;
+        spin_unlock(&user->rate->lock);
+        throttle_totals(&tstat.total_session, &tstat.total_room);
+        if (copy_to_user((void __user *)arg, &tstat, sizeof(tstat)))
+            return -EFAULT;
+        return 0;
+
+    case CHAT_SET_RING_SIZE:
+        // 容量是全局的，影响所有会话，不允许普通会话修改
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (arg == 0 || arg > MAX_RING_SIZE)
+            return -EINVAL;
+        return chat_resize(arg);
+
+    case CHAT_SET_EVENTFD:
+        return chat_set_eventfd(user, (int)arg);
+
+    case CHAT_SET_TTL:
+        if (copy_from_user(&treq, (void __user *)arg, sizeof(treq)))
+            return -EFAULT;
+        if (treq.ttl_ms > CHAT_TTL_MAX_MS)
+            return -EINVAL;
+        if (treq.scope == CHAT_SCOPE_SESSION)
+        {
+            WRITE_ONCE(user->ttl_ms, treq.ttl_ms);
+            return 0;
+        }
+        if (treq.scope != CHAT_SCOPE_ROOM || treq.room >= CHAT_MAX_ROOMS)
+            return -EINVAL;
+        // 与房间限速一样属于管理员设置
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        WRITE_ONCE(rooms[treq.room].ttl_ms, treq.ttl_ms);
+        return 0;
+
+    case CHAT_SET_BUSY_POLL:
+        if (arg > CHAT_BUSY_POLL_MAX_US)
+            return -EINVAL;
+        WRITE_ONCE(user->busy_poll_ns, (u64)arg * NSEC_PER_USEC);
+        return 0;
+
+    case CHAT_RECV_BATCH:
+        return chat_recv_batch(filp, user, (struct chat_recv_batch __user *)arg);
+
+    case CHAT_SET_FILTER:
+        // 参数为 0 表示取消过滤
+        filter = NULL;
+        if (arg)
+        {
+            filter = memdup_user((void __user *)arg, sizeof(*filter));
+            if (IS_ERR(filter))
+                return PTR_ERR(filter);
+            if (filter_check(filter))
+            {
+                kfree(filter);
+                return -EINVAL;
+            }
+        }
+        down(&(queue->sem));
+        filter = user_set_filter(user, filter);
+        up(&(queue->sem));
+        kfree(filter);
+        return 0;
+
+    case CHAT_GET_TOKEN:
+        down(&(queue->sem));
+        while (!user->token)
+            user_set_token(user, get_random_u64());
+        token = user->token;
+        up(&(queue->sem));
+        if (copy_to_user((void __user *)arg, &token, sizeof(token)))
+            return -EFAULT;
+        return 0;
+
+    case CHAT_RESUME:
+        if (copy_from_user(&token, (void __user *)arg, sizeof(token)))
+            return -EFAULT;
+        return chat_resume(user, token);
+
+    default:
+        return -ENOTTY;
+    }
 }
 
 module_init(ch_device_init);
@@ -0,0 +1,192 @@
+#ifndef CHAT_DEVICE_H
+#define CHAT_DEVICE_H
+
+// chat_device 模块与用户态程序共用的 ioctl 接口定义
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CHAT_LANE_NUM 2
+#define CHAT_LAT_BUCKETS 40     // log2 直方图的桶数，第 i 个桶统计 [2^i, 2^(i+1)) ns
+
+// 最近一次 read 取到的消息的元数据
+struct chat_msg_info
+{
+    __u64 enqueue_ns;   // 入队时间（ktime_get_ns）
+    __u64 dequeue_ns;   // 被当前会话读出的时间
+    __s32 sender_pid;
+    __s32 target_pid;   // 0 表示群发
+    __u32 lane;         // 0 为紧急通道，1 为群发通道
+    __u32 len;
+};
+
+// 每个通道的入队到出队延迟直方图
+struct chat_latency_hist
+{
+    __u64 count[CHAT_LANE_NUM];
+    __u64 buckets[CHAT_LANE_NUM][CHAT_LAT_BUCKETS];
+};
+
+// 慢消费者处理：会话落后超过阈值（消息数或时间）时采取的动作。只计会投递给该会话的消息，
+// 读的时候和每 100 毫秒的定时检查中都会判断，不读的会话同样会被处理
+#define CHAT_LAG_NONE   0   // 只统计，不处理
+#define CHAT_LAG_DETACH 1   // 断开会话，之后的 read 返回 -EPIPE
+#define CHAT_LAG_LOSSY  2   // 转为有损模式，丢弃超出阈值的旧消息
+
+struct chat_lag_policy
+{
+    __u32 max_msgs;     // 未读消息数阈值，0 表示不检查
+    __u32 max_ms;       // 最旧未读消息的等待时间阈值（毫秒），0 表示不检查
+    __u32 action;       // CHAT_LAG_*
+    __u32 pad;
+};
+
+struct chat_lag_stat
+{
+    __u64 lag_msgs;     // 当前未读消息数
+    __u64 lag_ns;       // 最旧未读消息已等待的时间
+    __u64 dropped;      // 被覆盖、过期或因有损模式丢弃的消息数
+    __u32 detached;
+    __u32 lossy;
+};
+
+// 房间：会话默认在 0 号房间，群发消息只投递给同一房间的会话
+#define CHAT_MAX_ROOMS 8
+
+// 令牌桶限速，0 表示该项不限
+struct chat_rate_limit
+{
+    __u32 msgs_per_sec;
+    __u32 bytes_per_sec;
+    __u32 burst_msgs;   // 桶容量，0 表示取一秒的额度
+    __u32 burst_bytes;
+};
+
+// 会话级限速作用于打开该会话的进程：同一进程的所有会话共用一个令牌桶。
+// 房间级限速由房间内所有发送者共享，写入挤出其他房间的消息也从写入房间的额度中扣除
+#define CHAT_SCOPE_SESSION 0
+#define CHAT_SCOPE_ROOM    1
+
+struct chat_rate_req
+{
+    __u32 scope;        // CHAT_SCOPE_*
+    __u32 room;         // scope 为 CHAT_SCOPE_ROOM 时有效
+    struct chat_rate_limit limit;
+};
+
+struct chat_throttle_stat
+{
+    __u64 session_throttled;    // 当前会话被限速的次数
+    __u64 total_session;        // 全部会话级限速次数
+    __u64 total_room;           // 全部房间级限速次数
+};
+
+// 消息存活时间（毫秒），0 表示不限。会话级设置作用于之后从该会话发出的消息，
+// 房间级设置（需要 CAP_SYS_ADMIN）作用于该房间的所有消息，两者都有时取较小值
+#define CHAT_TTL_MAX_MS 500000
+
+struct chat_ttl_req
+{
+    __u32 scope;        // CHAT_SCOPE_*
+    __u32 room;         // scope 为 CHAT_SCOPE_ROOM 时有效
+    __u32 ttl_ms;
+    __u32 pad;
+};
+
+// 订阅过滤：只作用于群发消息，私聊总是投递。各项条件同时满足才投递，
+// 不满足的消息不会唤醒读者，也不会被复制到用户空间
+#define CHAT_MAX_TAG 63             // 写入时用 "#<tag> " 前缀指定，缺省为 0
+#define CHAT_FILTER_MAX_PIDS 16
+#define CHAT_FILTER_PREFIX_LEN 32
+
+struct chat_filter
+{
+    __u64 tag_mask;             // 第 tag 位为 1 表示接收该类型，0 表示不限
+    __u32 npids;                // 只接收这些发送者的消息，0 表示不限
+    __u32 prefix_len;           // 只接收内容以 prefix 开头的消息，0 表示不限
+    __s32 pids[CHAT_FILTER_MAX_PIDS];
+    char prefix[CHAT_FILTER_PREFIX_LEN];
+};
+
+// 批量接收：每个描述符接收一条消息。至少取到 min_count 条或等待超过 timeout_us 微秒后返回，
+// 返回前把已经到达的消息尽量填满 count 个描述符；min_count 为 0 时只取已到达的消息，不等待
+#define CHAT_RECV_BATCH_MAX 256
+
+struct chat_recv_desc
+{
+    __u64 buf;                  // 消息内容的缓冲区地址
+    __u32 len;                  // 缓冲区长度
+    __u32 copied;               // 由内核填写：实际复制的字节数，消息更长时被截断
+    struct chat_msg_info info;  // 由内核填写：与 CHAT_GET_MSG_INFO 相同
+};
+
+struct chat_recv_batch
+{
+    __u64 descs;                // struct chat_recv_desc 数组的地址
+    __u32 count;                // 描述符个数，不超过 CHAT_RECV_BATCH_MAX
+    __u32 min_count;
+    __u32 timeout_us;
+    __u32 received;             // 由内核填写：取到的消息数，与返回值相同
+};
+
+// 忙轮询：阻塞读在睡眠前先在会话的读指针上自旋，最多 CHAT_SET_BUSY_POLL 给出的微秒数。
+// 实际自旋时间随观察到的消息到达间隔自适应，间隔超过上限时不自旋。适合绑定在专用核上的读者
+#define CHAT_BUSY_POLL_MAX_US 10000
+
+// 不经过设备文件的发送/接收接口，由 os_exp/syscall_modify 以 chat_send/chat_recv 系统调用提供。
+// 会话用 CHAT_GET_TOKEN 得到的 token 指定，只能在打开该会话的进程中使用；
+// chat_send 的 flags 低 8 位为消息类型标记（不超过 CHAT_MAX_TAG），代替 "#<tag> " 前缀
+#define CHAT_SEND_TAG_MASK 0xff
+#define CHAT_SEND_URGENT   0x100    // 群发消息也走紧急通道，代替 '!' 前缀
+
+// 通用 netlink 接口：每个房间对应一个组播组 "room0" ~ "room7"，
+// 群发消息以 CHAT_NL_CMD_MSG 组播给订阅了该房间的套接字。私聊消息不经 netlink 投递，
+// 只能从设备会话读出；本地进程也可以用 CHAT_NL_CMD_SEND 发消息（包括私聊），与写设备文件等价
+#define CHAT_NL_FAMILY "chat_device"
+#define CHAT_NL_VERSION 1
+#define CHAT_NL_GROUP_PREFIX "room"
+
+enum
+{
+    CHAT_NL_CMD_UNSPEC,
+    CHAT_NL_CMD_SEND,       // 用户态 -> 内核
+    CHAT_NL_CMD_MSG,        // 内核 -> 用户态
+};
+
+enum
+{
+    CHAT_NL_A_UNSPEC,
+    CHAT_NL_A_ROOM,         // u32
+    CHAT_NL_A_SENDER,       // u32，发送者 pid
+    CHAT_NL_A_TARGET,       // u32，目标 pid，0 表示群发
+    CHAT_NL_A_TS,           // u64，入队时间（ktime_get_ns）
+    CHAT_NL_A_CONTENT,      // 以 NUL 结尾的字符串
+    CHAT_NL_A_LANE,         // u32
+    CHAT_NL_A_TTL,          // u32，存活时间（毫秒），只用于 CHAT_NL_CMD_SEND
+    CHAT_NL_A_TAG,          // u32，消息类型
+    __CHAT_NL_A_MAX,
+};
+#define CHAT_NL_A_MAX (__CHAT_NL_A_MAX - 1)
+
+#define CHAT_IOC_MAGIC 'c'
+#define CHAT_GET_MSG_INFO   _IOR(CHAT_IOC_MAGIC, 1, struct chat_msg_info)
+#define CHAT_GET_LATENCY    _IOR(CHAT_IOC_MAGIC, 2, struct chat_latency_hist)
+#define CHAT_RESET_LATENCY  _IO(CHAT_IOC_MAGIC, 3)
+#define CHAT_SET_RING_SIZE  _IO(CHAT_IOC_MAGIC, 4)     // 参数为新的每通道容量，需要 CAP_SYS_ADMIN
+#define CHAT_SET_LAG_POLICY _IOW(CHAT_IOC_MAGIC, 5, struct chat_lag_policy)   // 比模块默认值宽松时需要 CAP_SYS_ADMIN
+#define CHAT_GET_LAG_STAT   _IOR(CHAT_IOC_MAGIC, 6, struct chat_lag_stat)
+#define CHAT_JOIN_ROOM      _IO(CHAT_IOC_MAGIC, 7)     // 参数为房间号
+#define CHAT_SET_RATE_LIMIT _IOW(CHAT_IOC_MAGIC, 8, struct chat_rate_req)
+#define CHAT_GET_THROTTLE_STAT _IOR(CHAT_IOC_MAGIC, 9, struct chat_throttle_stat)
+// 参数为 eventfd 的文件描述符，-1 表示解绑。会话有新消息时 eventfd 计数加一，
+// 之后直到把会话读空（read 返回 EAGAIN）之前不会再次通知
+#define CHAT_SET_EVENTFD    _IO(CHAT_IOC_MAGIC, 10)
+// 申请会话 token：之后关闭会话（包括为升级模块而关闭）会保留读指针，
+// 新打开的会话用 CHAT_RESUME 传入同一个 token 即可从原来的位置继续读
+#define CHAT_GET_TOKEN      _IOR(CHAT_IOC_MAGIC, 11, __u64)
+#define CHAT_RESUME         _IOW(CHAT_IOC_MAGIC, 12, __u64)
+#define CHAT_SET_TTL        _IOW(CHAT_IOC_MAGIC, 13, struct chat_ttl_req)
+#define CHAT_SET_FILTER     _IOW(CHAT_IOC_MAGIC, 14, struct chat_filter)    // 参数为 NULL 时取消过滤
+#define CHAT_RECV_BATCH     _IOWR(CHAT_IOC_MAGIC, 15, struct chat_recv_batch)
+#define CHAT_SET_BUSY_POLL  _IO(CHAT_IOC_MAGIC, 16)     // 参数为自旋上限（微秒），0 表示关闭
+
+#endif
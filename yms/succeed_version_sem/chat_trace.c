@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "chat_device.h"
+
+// 聊天负载的录制与回放工具，保证不同模块版本的性能测试使用完全相同的流量
+//
+//   chat_trace record <trace> [会话数]
+//       打开若干会话，从标准输入读取 "<会话号> <消息>"（消息可带 @pid 或 ! 前缀）并发送，
+//       同时记录所有收发事件。@pid 必须是某个会话的 pid，记录为该会话的序号
+//   chat_trace gen <trace> <会话数> <秒数> <总消息速率> [私聊百分比] [消息长度]
+//       生成泊松到达的合成负载
+//   chat_trace replay <trace> [倍速] [报告输出] [基线报告]
+//       按 trace 中的时间间隔（除以倍速）回放，输出吞吐和延迟，给出基线报告时打印差值
+//
+// trace 为文本格式，每行一个事件：
+//   <相对时间 ns> S <发送会话> <目标会话，-1 为群发> <长度>
+//   <相对时间 ns> R <接收会话> <发送者 pid> <长度>
+//
+// 私聊按进程号投递，同一进程打开的会话会同时收到。为了让每个会话有自己的 pid，
+// 每个会话由一个子进程打开后把描述符传回来，子进程一直等到会话关闭才退出，
+// 收发仍然都在本进程中进行
+
+#define DEVICE_PATH "/dev/chat_device"
+#define MAX_MSG_LEN 256
+#define MAX_SESSIONS 4096
+#define MAX_EVENTS 256
+
+struct send_event {
+    long long t_ns;
+    int sender;
+    int target;
+    int size;
+};
+
+static int fds[MAX_SESSIONS];
+static pid_t pids[MAX_SESSIONS];    // 打开会话的子进程，也就是会话的 pid
+static int holders[MAX_SESSIONS];   // 与子进程相连的套接字，关闭后子进程退出
+static int nsessions;
+static volatile int running = 1;
+
+static FILE *trace_out;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long start_ns;
+
+// 回放统计
+static long long *latencies;
+static long latency_count;
+static long latency_cap;
+static long kernel_lat_sum_ns;
+static long received;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 子进程打开设备，通过 SCM_RIGHTS 把描述符传回父进程，然后等到父进程关闭套接字
+static void session_holder(int sock) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh = { 0 };
+    struct cmsghdr *cm;
+    struct iovec iov;
+    char c = 0;
+    int fd = open(DEVICE_PATH, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0) {
+        perror("Failed to open device");
+        _exit(1);
+    }
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    if (sendmsg(sock, &mh, 0) != 1)
+        _exit(1);
+    close(fd);
+    while (read(sock, &c, 1) > 0)
+        ;
+    _exit(0);
+}
+
+static int recv_session(int sock) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh = { 0 };
+    struct cmsghdr *cm;
+    struct iovec iov;
+    char c;
+    int fd = -1;
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &mh, 0) != 1)
+        return -1;
+    cm = CMSG_FIRSTHDR(&mh);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    return fd;
+}
+
+static void close_sessions(void) {
+    int i;
+    for (i = 0; i < nsessions; i++) {
+        close(fds[i]);
+        close(holders[i]);
+        waitpid(pids[i], NULL, 0);
+    }
+    nsessions = 0;
+}
+
+static int open_sessions(int n) {
+    int sv[2];
+    int i;
+
+    if (n <= 0 || n > MAX_SESSIONS) {
+        printf("session count must be in [1, %d]\n", MAX_SESSIONS);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("socketpair");
+            close_sessions();
+            return -1;
+        }
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            // 不能持有其他会话的套接字，否则那些子进程等不到父进程关闭
+            for (int j = 0; j < i; j++) {
+                close(holders[j]);
+                close(fds[j]);
+            }
+            close(sv[0]);
+            session_holder(sv[1]);
+        }
+        close(sv[1]);
+        if (pids[i] < 0) {
+            perror("fork");
+            close(sv[0]);
+            close_sessions();
+            return -1;
+        }
+        holders[i] = sv[0];
+        fds[i] = recv_session(sv[0]);
+        if (fds[i] < 0) {
+            printf("Failed to open session %d\n", i);
+            close(sv[0]);
+            waitpid(pids[i], NULL, 0);
+            close_sessions();
+            return -1;
+        }
+        nsessions = i + 1;
+    }
+    return 0;
+}
+
+static int session_of(pid_t pid) {
+    int i;
+    for (i = 0; i < nsessions; i++) {
+        if (pids[i] == pid)
+            return i;
+    }
+    return -1;
+}
+
+// 所有会话的读事件由一个 epoll 线程处理
+static void *receiver_loop(void *arg) {
+    int record = *(int *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    char buffer[MAX_MSG_LEN];
+    struct chat_msg_info info;
+    int epfd = epoll_create1(0);
+    int i, n;
+
+    for (i = 0; i < nsessions; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+
+    while (running) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, 10);
+        for (i = 0; i < n; i++) {
+            int s = events[i].data.u32;
+            ssize_t len;
+
+            while ((len = read(fds[s], buffer, sizeof(buffer) - 1)) > 0) {
+                long long t = now_ns();
+                buffer[len] = '\0';
+                if (ioctl(fds[s], CHAT_GET_MSG_INFO, &info) != 0)
+                    memset(&info, 0, sizeof(info));
+
+                if (record) {
+                    pthread_mutex_lock(&trace_lock);
+                    fprintf(trace_out, "%lld R %d %d %zd\n", t - start_ns, s, info.sender_pid, len);
+                    pthread_mutex_unlock(&trace_lock);
+                    continue;
+                }
+
+                // 回放时消息以发送时刻开头，据此计算端到端延迟
+                received++;
+                kernel_lat_sum_ns += info.dequeue_ns - info.enqueue_ns;
+                if (latency_count < latency_cap)
+                    latencies[latency_count++] = t - atoll(buffer);
+            }
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+static int do_record(const char *path, int n) {
+    char line[MAX_MSG_LEN + 16];
+    pthread_t receiver;
+    int record = 1;
+
+    trace_out = fopen(path, "w");
+    if (!trace_out) {
+        perror("Failed to open trace");
+        return 1;
+    }
+    if (open_sessions(n) < 0)
+        return 1;
+
+    fprintf(trace_out, "# chat trace v1 sessions %d\n", n);
+    start_ns = now_ns();
+    pthread_create(&receiver, NULL, receiver_loop, &record);
+
+    printf("Recording %d sessions. Input \"<session> <message>\", EOF to stop.\n", n);
+    for (int i = 0; i < n; i++)
+        printf("  session %d: pid %d\n", i, pids[i]);
+    while (fgets(line, sizeof(line), stdin)) {
+        char *msg;
+        int s = strtol(line, &msg, 10);
+        int target = -1;
+        size_t len;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (s < 0 || s >= n || *msg != ' ') {
+            printf("Invalid session\n");
+            continue;
+        }
+        msg++;
+        // 私聊目标记录为会话序号，回放时才能发给对应的会话
+        if (msg[0] == '@') {
+            target = session_of(atoi(msg + 1));
+            if (target < 0) {
+                printf("Private target must be the pid of a session\n");
+                continue;
+            }
+        }
+        len = strlen(msg);
+        if (write(fds[s], msg, len) < 0) {
+            perror("Error writing to device");
+            continue;
+        }
+
+        pthread_mutex_lock(&trace_lock);
+        fprintf(trace_out, "%lld S %d %d %zu\n", now_ns() - start_ns, s, target, len);
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    // 给接收线程一点时间收完最后的消息
+    usleep(100000);
+    running = 0;
+    pthread_join(receiver, NULL);
+    close_sessions();
+    fclose(trace_out);
+    return 0;
+}
+
+static int do_gen(const char *path, int n, int seconds, double rate, int private_pct, int size) {
+    FILE *fp = fopen(path, "w");
+    double t = 0;
+
+    if (!fp || n <= 0 || rate <= 0 || size <= 0 || size >= MAX_MSG_LEN) {
+        printf("invalid arguments\n");
+        return 1;
+    }
+    srand(1);   // 固定种子，同样的参数总是生成同样的 trace
+    fprintf(fp, "# chat trace v1 sessions %d\n", n);
+    while (1) {
+        // 指数分布的到达间隔
+        t += -log((rand() + 1.0) / (RAND_MAX + 2.0)) / rate;
+        if (t >= seconds)
+            break;
+        fprintf(fp, "%lld S %d %d %d\n", (long long)(t * 1e9), rand() % n,
+                rand() % 100 < private_pct ? rand() % n : -1, size);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static struct send_event *load_trace(const char *path, long *count, int *sessions) {
+    FILE *fp = fopen(path, "r");
+    struct send_event *events = NULL;
+    char line[256];
+    long cap = 0;
+
+    *count = 0;
+    *sessions = 0;
+    if (!fp) {
+        perror("Failed to open trace");
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        struct send_event ev;
+        char type;
+
+        if (sscanf(line, "# chat trace v1 sessions %d", sessions) == 1)
+            continue;
+        if (sscanf(line, "%lld %c %d %d %d", &ev.t_ns, &type, &ev.sender, &ev.target, &ev.size) != 5 || type != 'S')
+            continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            events = realloc(events, cap * sizeof(*events));
+        }
+        events[(*count)++] = ev;
+        if (ev.sender >= *sessions)
+            *sessions = ev.sender + 1;
+        if (ev.target >= *sessions)
+            *sessions = ev.target + 1;
+    }
+    fclose(fp);
+    return events;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 报告为 "键 值" 格式，方便与基线逐项比较
+static void print_delta(const char *baseline, const char *key, double value) {
+    FILE *fp = fopen(baseline, "r");
+    char k[64];
+    double v;
+
+    if (!fp)
+        return;
+    while (fscanf(fp, "%63s %lf", k, &v) == 2) {
+        if (strcmp(k, key) == 0 && v != 0) {
+            printf("    %-16s baseline %.1f, delta %+.1f (%+.1f%%)\n", key, v, value - v, (value - v) * 100 / v);
+            break;
+        }
+    }
+    fclose(fp);
+}
+
+static int do_replay(const char *path, double speed, const char *report, const char *baseline) {
+    struct send_event *events;
+    pthread_t receiver;
+    char msg[MAX_MSG_LEN];
+    long count, i, sent = 0, dropped = 0;
+    long long elapsed;
+    int sessions;
+    int record = 0;
+    const char *keys[] = { "send_rate", "recv_rate", "p50_us", "p99_us", "max_us", "kernel_avg_us" };
+    double values[6];
+    FILE *fp;
+    int k;
+
+    events = load_trace(path, &count, &sessions);
+    if (!events || count == 0 || speed <= 0) {
+        printf("empty trace or invalid speed\n");
+        return 1;
+    }
+    if (open_sessions(sessions) < 0)
+        return 1;
+
+    latency_cap = count * sessions < 10000000 ? count * sessions : 10000000;
+    latencies = malloc(latency_cap * sizeof(long long));
+    pthread_create(&receiver, NULL, receiver_loop, &record);
+
+    start_ns = now_ns();
+    for (i = 0; i < count; i++) {
+        struct send_event *ev = &events[i];
+        long long due = start_ns + (long long)(ev->t_ns / speed);
+        long long now;
+        int len;
+
+        while ((now = now_ns()) < due) {
+            if (due - now > 200000)
+                usleep((due - now - 100000) / 1000);
+        }
+
+        // 私聊发给目标会话的 pid，只有该会话收到；消息开头写入发送时刻
+        if (ev->target >= 0)
+            len = snprintf(msg, sizeof(msg), "@%d %lld ", pids[ev->target], now_ns());
+        else
+            len = snprintf(msg, sizeof(msg), "%lld ", now_ns());
+        while (len < ev->size && len < MAX_MSG_LEN - 1)
+            msg[len++] = 'x';
+
+        if (write(fds[ev->sender], msg, len) < 0)
+            dropped++;
+        else
+            sent++;
+    }
+    elapsed = now_ns() - start_ns;
+
+    usleep(200000);
+    running = 0;
+    pthread_join(receiver, NULL);
+    close_sessions();
+
+    qsort(latencies, latency_count, sizeof(long long), cmp_ll);
+    values[0] = sent * 1e9 / elapsed;
+    values[1] = received * 1e9 / elapsed;
+    values[2] = latency_count ? latencies[latency_count / 2] / 1e3 : 0;
+    values[3] = latency_count ? latencies[latency_count * 99 / 100] / 1e3 : 0;
+    values[4] = latency_count ? latencies[latency_count - 1] / 1e3 : 0;
+    values[5] = received ? (double)kernel_lat_sum_ns / received / 1e3 : 0;
+
+    printf("replayed %ld sends over %d sessions at %.1fx in %.3f s (%ld failed)\n",
+           count, sessions, speed, elapsed / 1e9, dropped);
+    fp = report ? fopen(report, "w") : NULL;
+    for (k = 0; k < 6; k++) {
+        printf("  %-16s %.1f\n", keys[k], values[k]);
+        if (baseline)
+            print_delta(baseline, keys[k], values[k]);
+        if (fp)
+            fprintf(fp, "%s %.3f\n", keys[k], values[k]);
+    }
+    if (fp)
+        fclose(fp);
+
+    free(latencies);
+    free(events);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "record") == 0)
+        return do_record(argv[2], argc > 3 ? atoi(argv[3]) : 4);
+    if (argc >= 6 && strcmp(argv[1], "gen") == 0)
+        return do_gen(argv[2], atoi(argv[3]), atoi(argv[4]), atof(argv[5]),
+                      argc > 6 ? atoi(argv[6]) : 0, argc > 7 ? atoi(argv[7]) : 32);
+    if (argc >= 3 && strcmp(argv[1], "replay") == 0)
+        return do_replay(argv[2], argc > 3 ? atof(argv[3]) : 1.0,
+                         argc > 4 ? argv[4] : NULL, argc > 5 ? argv[5] : NULL);
+
+    printf("usage:\n");
+    printf("  %s record <trace> [sessions]\n", argv[0]);
+    printf("  %s gen <trace> <sessions> <seconds> <msgs/s> [private%%] [size]\n", argv[0]);
+    printf("  %s replay <trace> [speed] [report_out] [baseline_report]\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -6,19 +6,28 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include "chat_device.h"
 
 #define DEVICE_PATH "/dev/chat_device"
 #define MAX_MSG_LEN 256
 void *receive_messages(void *arg) {
     int fd = *(int *)arg;
     char buffer[MAX_MSG_LEN];
+    struct chat_msg_info info;
     ssize_t len;
 
     while (1) {
-        len = read(fd, buffer, sizeof(buffer));
+        // 设备读阻塞到有消息为止，返回值就是消息长度，预留一个字节放结束符
+        len = read(fd, buffer, sizeof(buffer) - 1);
         if (len > 0) {
-            buffer[len - 8] = '\0';
-            printf("[Received]: %s\n", buffer);
+            buffer[len] = '\0';
+            // 取出刚读到的消息的时间戳，显示它在队列中停留了多久
+            if (ioctl(fd, CHAT_GET_MSG_INFO, &info) == 0) {
+                printf("[Received from %d, queued %llu us]: %s\n", info.sender_pid,
+                       (unsigned long long)(info.dequeue_ns - info.enqueue_ns) / 1000, buffer);
+            } else {
+                printf("[Received]: %s\n", buffer);
+            }
         } else if (len < 0) {
             perror("Error reading from device");
             break;
@@ -26,10 +35,13 @@ void *receive_messages(void *arg) {
     }
     return NULL;
 }
-int main() {
+// 用法：./client [token]
+// 给出上次退出时打印的 token 则从上次读到的位置继续，模块升级前后都可以接续
+int main(int argc, char *argv[]) {
     int fd;
     char input[MAX_MSG_LEN];
     unsigned long arg;
+    unsigned long long token;
     pthread_t receiver_thread;
 
     // 打开字符设备
@@ -39,6 +51,14 @@ int main() {
         return EXIT_FAILURE;
     }
 
+    if (argc > 1) {
+        token = strtoull(argv[1], NULL, 0);
+        if (ioctl(fd, CHAT_RESUME, &token) < 0)
+            perror("Failed to resume session");
+    }
+    if (ioctl(fd, CHAT_GET_TOKEN, &token) < 0)
+        token = 0;
+
     // 启动接收线程
     if (pthread_create(&receiver_thread, NULL, receive_messages, &fd) != 0) {
         perror("Failed to create receiver thread");
@@ -71,6 +91,6 @@ int main() {
     pthread_cancel(receiver_thread);
     pthread_join(receiver_thread, NULL);
 
-    printf("Client exited.\n");
+    printf("Client exited. resume with: %s %#llx\n", argv[0], token);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include "chat_device.h"
+
+// 事件循环客户端：少量线程，每个线程用一个 epoll 循环驱动大量设备会话
+// 用法：./epoll_client [会话数] [线程数] [秒数] [每会话每秒消息数] [efd] [batch]
+// 给出 efd 时，每个会话绑定一个 eventfd，epoll 等待 eventfd 而不是设备 fd；
+// 给出 batch 时用 CHAT_RECV_BATCH 一次取回多条消息，代替逐条 read
+
+#define DEVICE_PATH "/dev/chat_device"
+#define MAX_MSG_LEN 256
+#define READ_BATCH 32       // 每次可读事件最多连续读取的消息数
+#define OUTQ_MAX 8          // 每个会话最多积压的待发消息数，超过即视为背压
+#define MAX_EVENTS 256
+
+struct session {
+    int fd;
+    int efd;                // 绑定的 eventfd，未使用时为 -1
+    int id;
+    int out_pending;        // 待发消息数
+    int out_blocked;        // 写返回 EAGAIN，正在等待 EPOLLOUT
+    double credit;          // 按速率累积的发送额度
+    long seq;
+};
+
+struct worker {
+    pthread_t thread;
+    struct session *sessions;
+    int count;
+    int epfd;
+    long sent;
+    long received;
+    long backpressure;      // 因积压而放弃生成的消息数
+};
+
+static volatile int running = 1;
+static double rate = 1.0;
+static int use_efd;
+static int use_batch;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_interest(struct worker *w, struct session *s, int want_out) {
+    struct epoll_event ev;
+    // eventfd 模式下可读事件来自 eventfd，设备 fd 只关心可写
+    ev.events = (use_efd ? 0 : EPOLLIN) | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->out_blocked = want_out;
+}
+
+// 尽量发出积压的消息，设备暂时写不进去时改为等待 EPOLLOUT
+static void flush_session(struct worker *w, struct session *s) {
+    char msg[MAX_MSG_LEN];
+    int len;
+
+    while (s->out_pending > 0) {
+        len = snprintf(msg, sizeof(msg), "session %d seq %ld", s->id, s->seq);
+        if (write(s->fd, msg, len) < 0) {
+            if (errno == EAGAIN) {
+                if (!s->out_blocked)
+                    set_interest(w, s, 1);
+                return;
+            }
+            perror("Error writing to device");
+            return;
+        }
+        s->seq++;
+        s->out_pending--;
+        w->sent++;
+    }
+    if (s->out_blocked)
+        set_interest(w, s, 0);
+}
+
+// 批量读取：一次可读事件连续读到 EAGAIN 或达到批量上限。
+// eventfd 只在会话被读空后才会再次通知，所以这种模式下必须一直读到 EAGAIN
+// 每次 ioctl 取回已经到达的至多 READ_BATCH 条消息，不等待
+static void drain_batch(struct worker *w, struct session *s) {
+    static __thread char buffers[READ_BATCH][MAX_MSG_LEN];
+    struct chat_recv_desc descs[READ_BATCH];
+    struct chat_recv_batch req;
+    int i, n;
+
+    for (i = 0; i < READ_BATCH; i++) {
+        descs[i].buf = (unsigned long)buffers[i];
+        descs[i].len = MAX_MSG_LEN;
+    }
+    req.descs = (unsigned long)descs;
+    req.count = READ_BATCH;
+    req.min_count = 0;
+    req.timeout_us = 0;
+
+    // 绑定了 eventfd 时必须读空才会再次通知
+    do {
+        n = ioctl(s->fd, CHAT_RECV_BATCH, &req);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                perror("CHAT_RECV_BATCH");
+            return;
+        }
+        w->received += n;
+    } while (s->efd >= 0 && n == READ_BATCH);
+}
+
+static void drain_session(struct worker *w, struct session *s) {
+    char buffer[MAX_MSG_LEN];
+    uint64_t events;
+    int i;
+
+    if (s->efd >= 0)
+        read(s->efd, &events, sizeof(events));
+    if (use_batch) {
+        drain_batch(w, s);
+        return;
+    }
+    for (i = 0; s->efd >= 0 || i < READ_BATCH; i++) {
+        ssize_t len = read(s->fd, buffer, sizeof(buffer) - 1);
+        if (len < 0) {
+            if (errno != EAGAIN)
+                perror("Error reading from device");
+            return;
+        }
+        w->received++;
+    }
+}
+
+static void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    double last = now_sec();
+    int i, n;
+
+    while (running) {
+        double now = now_sec();
+        double dt = now - last;
+        last = now;
+
+        // 按速率为每个会话生成待发消息，积压已满的会话不再生成
+        for (i = 0; i < w->count && rate > 0; i++) {
+            struct session *s = &w->sessions[i];
+            s->credit += rate * dt;
+            while (s->credit >= 1.0) {
+                s->credit -= 1.0;
+                if (s->out_pending >= OUTQ_MAX) {
+                    w->backpressure++;
+                    continue;
+                }
+                s->out_pending++;
+            }
+            if (s->out_pending > 0 && !s->out_blocked)
+                flush_session(w, s);
+        }
+
+        n = epoll_wait(w->epfd, events, MAX_EVENTS, 1);
+        for (i = 0; i < n; i++) {
+            struct session *s = events[i].data.ptr;
+            if (events[i].events & EPOLLIN)
+                drain_session(w, s);
+            if (events[i].events & EPOLLOUT)
+                flush_session(w, s);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nsessions = argc > 1 ? atoi(argv[1]) : 1000;
+    int nthreads = argc > 2 ? atoi(argv[2]) : 4;
+    int seconds = argc > 3 ? atoi(argv[3]) : 10;
+    struct worker *workers;
+    struct session *sessions;
+    struct rlimit rl;
+    long sent, received, backpressure, last_received = 0;
+    int i, t;
+
+    if (argc > 4)
+        rate = atof(argv[4]);
+    for (i = 5; i < argc; i++) {
+        use_efd |= strcmp(argv[i], "efd") == 0;
+        use_batch |= strcmp(argv[i], "batch") == 0;
+    }
+    if (nsessions <= 0 || nthreads <= 0 || nthreads > nsessions) {
+        printf("usage: %s [sessions] [threads] [seconds] [msgs/s per session] [efd] [batch]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // 每个会话一个 fd，先尽量提高文件描述符上限
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nsessions * 2 + 64) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)nsessions * 2 + 64 ? rl.rlim_max : (rlim_t)nsessions * 2 + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    sessions = calloc(nsessions, sizeof(struct session));
+    workers = calloc(nthreads, sizeof(struct worker));
+    if (!sessions || !workers)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < nsessions; i++) {
+        sessions[i].id = i;
+        sessions[i].fd = open(DEVICE_PATH, O_RDWR | O_NONBLOCK);
+        if (sessions[i].fd < 0) {
+            perror("Failed to open device");
+            return EXIT_FAILURE;
+        }
+        sessions[i].efd = -1;
+        if (use_efd) {
+            sessions[i].efd = eventfd(0, EFD_NONBLOCK);
+            if (sessions[i].efd < 0 || ioctl(sessions[i].fd, CHAT_SET_EVENTFD, sessions[i].efd) < 0) {
+                perror("Failed to bind eventfd");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // 会话平均分给各个线程，每个线程一个 epoll 实例
+    for (t = 0; t < nthreads; t++) {
+        struct worker *w = &workers[t];
+        int begin = (long)nsessions * t / nthreads;
+        int end = (long)nsessions * (t + 1) / nthreads;
+
+        w->sessions = &sessions[begin];
+        w->count = end - begin;
+        w->epfd = epoll_create1(0);
+        if (w->epfd < 0) {
+            perror("epoll_create1");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < w->count; i++) {
+            struct epoll_event ev;
+            ev.events = use_efd ? 0 : EPOLLIN;
+            ev.data.ptr = &w->sessions[i];
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->sessions[i].fd, &ev) < 0) {
+                perror("epoll_ctl");
+                return EXIT_FAILURE;
+            }
+            ev.events = EPOLLIN;
+            if (use_efd && epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->sessions[i].efd, &ev) < 0) {
+                perror("epoll_ctl");
+                return EXIT_FAILURE;
+            }
+        }
+        if (pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+            perror("Failed to create worker thread");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%d sessions on %d threads, %.1f msg/s per session%s%s\n", nsessions, nthreads, rate,
+           use_efd ? ", eventfd notification" : "", use_batch ? ", batched receive" : "");
+    for (i = 0; i < seconds; i++) {
+        sleep(1);
+        // 统计数据只用于显示，不加锁读取即可
+        sent = received = backpressure = 0;
+        for (t = 0; t < nthreads; t++) {
+            sent += workers[t].sent;
+            received += workers[t].received;
+            backpressure += workers[t].backpressure;
+        }
+        printf("[%2ds] sent %ld, received %ld (+%ld/s), backpressure %ld\n",
+               i + 1, sent, received, received - last_received, backpressure);
+        last_received = received;
+    }
+
+    running = 0;
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        close(workers[t].epfd);
+    }
+    for (i = 0; i < nsessions; i++) {
+        close(sessions[i].fd);
+        if (sessions[i].efd >= 0)
+            close(sessions[i].efd);
+    }
+    free(sessions);
+    free(workers);
+    return EXIT_SUCCESS;
+}
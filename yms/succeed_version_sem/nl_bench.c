@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include "chat_device.h"
+
+// 群发负载下比较两种接收方式：
+//   dev：每个接收者打开一个 /dev/chat_device 会话，各自 read 共享环形队列
+//   nl ：每个接收者一个 generic netlink 套接字，加入房间组播组，由内核扇出
+// 两轮都由同一个发送者通过设备文件写入，消息内容里带发送时刻，用来算端到端延迟
+// 用法：./nl_bench [接收者数] [消息数] [房间号]
+
+#define DEVICE_PATH "/dev/chat_device"
+#define MAX_MSG_LEN 256
+#define LAT_SLOTS 10001     // 1us 一格，最后一格收纳 >= 10ms 的样本
+#define IDLE_MS 1000        // 接收者空闲这么久就认为发送已结束
+
+struct receiver {
+    pthread_t thread;
+    int fd;
+    long received;
+    long dropped;           // netlink 套接字缓冲溢出（ENOBUFS）的次数
+    long long lat_sum;
+    long long lat_max;
+    long *lat;
+};
+
+static int total_msgs;
+static int family_id;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 消息内容是 "<发送时刻 ns> bench"，与 ktime_get_ns 同为 CLOCK_MONOTONIC
+static void account(struct receiver *r, const char *content) {
+    long long lat = now_ns() - atoll(content);
+    long us = lat / 1000;
+
+    if (lat < 0)
+        return;
+    r->received++;
+    r->lat_sum += lat;
+    if (lat > r->lat_max)
+        r->lat_max = lat;
+    r->lat[us < LAT_SLOTS - 1 ? us : LAT_SLOTS - 1]++;
+}
+
+static void *dev_receiver(void *arg) {
+    struct receiver *r = arg;
+    struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+    char buffer[MAX_MSG_LEN];
+
+    while (r->received < total_msgs) {
+        ssize_t len = read(r->fd, buffer, sizeof(buffer) - 1);
+        if (len < 0) {
+            if (errno != EAGAIN)
+                break;
+            if (poll(&pfd, 1, IDLE_MS) <= 0)
+                break;
+            continue;
+        }
+        buffer[len] = '\0';
+        account(r, buffer);
+    }
+    return NULL;
+}
+
+// 取出 netlink 消息中的 CHAT_NL_A_CONTENT 属性
+static const char *nl_content(struct nlmsghdr *nlh) {
+    struct genlmsghdr *gh = NLMSG_DATA(nlh);
+    struct nlattr *na = (struct nlattr *)((char *)gh + GENL_HDRLEN);
+    int rem = nlh->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN;
+
+    while (rem >= (int)sizeof(*na) && na->nla_len >= sizeof(*na) && na->nla_len <= rem) {
+        if ((na->nla_type & NLA_TYPE_MASK) == CHAT_NL_A_CONTENT)
+            return (const char *)na + NLA_HDRLEN;
+        rem -= NLA_ALIGN(na->nla_len);
+        na = (struct nlattr *)((char *)na + NLA_ALIGN(na->nla_len));
+    }
+    return NULL;
+}
+
+static void *nl_receiver(void *arg) {
+    struct receiver *r = arg;
+    struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+    char buffer[16384];
+
+    while (r->received < total_msgs) {
+        struct nlmsghdr *nlh;
+        ssize_t len;
+
+        if (poll(&pfd, 1, IDLE_MS) <= 0)
+            break;
+        len = recv(r->fd, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                r->dropped++;
+                continue;
+            }
+            break;
+        }
+        for (nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            const char *content;
+            if (nlh->nlmsg_type != family_id)
+                continue;
+            content = nl_content(nlh);
+            if (content)
+                account(r, content);
+        }
+    }
+    return NULL;
+}
+
+// 向 nlctrl 查询 chat_device 族的 id 和指定房间组播组的 id
+static int resolve_family(int room, int *group_id) {
+    struct {
+        struct nlmsghdr nlh;
+        struct genlmsghdr gh;
+        char attrs[64];
+    } req;
+    struct nlattr *na;
+    char buffer[8192];
+    char group_name[GENL_NAMSIZ];
+    struct nlmsghdr *nlh;
+    ssize_t len;
+    int fd, rem;
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if (fd < 0)
+        return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_type = GENL_ID_CTRL;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST;
+    req.gh.cmd = CTRL_CMD_GETFAMILY;
+    req.gh.version = 1;
+    na = (struct nlattr *)req.attrs;
+    na->nla_type = CTRL_ATTR_FAMILY_NAME;
+    na->nla_len = NLA_HDRLEN + sizeof(CHAT_NL_FAMILY);
+    memcpy((char *)na + NLA_HDRLEN, CHAT_NL_FAMILY, sizeof(CHAT_NL_FAMILY));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(na->nla_len));
+
+    if (send(fd, &req, req.nlh.nlmsg_len, 0) < 0 || (len = recv(fd, buffer, sizeof(buffer), 0)) < 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    nlh = (struct nlmsghdr *)buffer;
+    if (!NLMSG_OK(nlh, len) || nlh->nlmsg_type == NLMSG_ERROR)
+        return -1;
+
+    snprintf(group_name, sizeof(group_name), CHAT_NL_GROUP_PREFIX "%d", room);
+    *group_id = -1;
+    na = (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+    rem = nlh->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN;
+    while (rem >= (int)sizeof(*na) && na->nla_len >= sizeof(*na) && na->nla_len <= rem) {
+        if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
+            family_id = *(__u16 *)((char *)na + NLA_HDRLEN);
+        } else if ((na->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_MCAST_GROUPS) {
+            // 嵌套：每个组是一个嵌套属性，内含组名和组 id
+            struct nlattr *grp = (struct nlattr *)((char *)na + NLA_HDRLEN);
+            int grem = na->nla_len - NLA_HDRLEN;
+            while (grem >= (int)sizeof(*grp) && grp->nla_len >= sizeof(*grp) && grp->nla_len <= grem) {
+                struct nlattr *ga = (struct nlattr *)((char *)grp + NLA_HDRLEN);
+                int arem = grp->nla_len - NLA_HDRLEN;
+                const char *name = NULL;
+                int id = -1;
+                while (arem >= (int)sizeof(*ga) && ga->nla_len >= sizeof(*ga) && ga->nla_len <= arem) {
+                    if (ga->nla_type == CTRL_ATTR_MCAST_GRP_NAME)
+                        name = (const char *)ga + NLA_HDRLEN;
+                    else if (ga->nla_type == CTRL_ATTR_MCAST_GRP_ID)
+                        id = *(__u32 *)((char *)ga + NLA_HDRLEN);
+                    arem -= NLA_ALIGN(ga->nla_len);
+                    ga = (struct nlattr *)((char *)ga + NLA_ALIGN(ga->nla_len));
+                }
+                if (name && strcmp(name, group_name) == 0)
+                    *group_id = id;
+                grem -= NLA_ALIGN(grp->nla_len);
+                grp = (struct nlattr *)((char *)grp + NLA_ALIGN(grp->nla_len));
+            }
+        }
+        rem -= NLA_ALIGN(na->nla_len);
+        na = (struct nlattr *)((char *)na + NLA_ALIGN(na->nla_len));
+    }
+    return family_id > 0 && *group_id >= 0 ? 0 : -1;
+}
+
+static int open_receiver(int use_nl, int room, int group_id) {
+    int fd, rcvbuf = 4 << 20;
+    struct sockaddr_nl addr;
+
+    if (!use_nl) {
+        fd = open(DEVICE_PATH, O_RDWR | O_NONBLOCK);
+        if (fd >= 0 && room && ioctl(fd, CHAT_JOIN_ROOM, room) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group_id, sizeof(group_id)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static long percentile(long *lat, long count, double p) {
+    long want = (long)(count * p), seen = 0;
+    int i;
+
+    for (i = 0; i < LAT_SLOTS; i++) {
+        seen += lat[i];
+        if (seen > want)
+            return i;
+    }
+    return LAT_SLOTS - 1;
+}
+
+static int run(const char *name, int use_nl, int nreceivers, int room, int group_id) {
+    struct receiver *receivers = calloc(nreceivers, sizeof(struct receiver));
+    long *lat = calloc(LAT_SLOTS, sizeof(long));
+    char msg[MAX_MSG_LEN];
+    long long start, send_ns, elapsed, lat_sum = 0, lat_max = 0;
+    long received = 0, dropped = 0;
+    int sender, i, j;
+
+    if (!receivers || !lat)
+        return -1;
+
+    sender = open(DEVICE_PATH, O_RDWR);
+    if (sender < 0 || (room && ioctl(sender, CHAT_JOIN_ROOM, room) < 0)) {
+        perror("Failed to open sender session");
+        return -1;
+    }
+
+    for (i = 0; i < nreceivers; i++) {
+        struct receiver *r = &receivers[i];
+        r->lat = calloc(LAT_SLOTS, sizeof(long));
+        r->fd = open_receiver(use_nl, room, group_id);
+        if (!r->lat || r->fd < 0) {
+            perror("Failed to open receiver");
+            return -1;
+        }
+        if (pthread_create(&r->thread, NULL, use_nl ? nl_receiver : dev_receiver, r) != 0) {
+            perror("Failed to create receiver thread");
+            return -1;
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < total_msgs; i++) {
+        int len = snprintf(msg, sizeof(msg), "%lld bench", now_ns());
+        while (write(sender, msg, len) < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("Error writing to device");
+                return -1;
+            }
+        }
+    }
+    send_ns = now_ns() - start;
+
+    for (i = 0; i < nreceivers; i++) {
+        struct receiver *r = &receivers[i];
+        pthread_join(r->thread, NULL);
+        received += r->received;
+        dropped += r->dropped;
+        lat_sum += r->lat_sum;
+        if (r->lat_max > lat_max)
+            lat_max = r->lat_max;
+        for (j = 0; j < LAT_SLOTS; j++)
+            lat[j] += r->lat[j];
+        close(r->fd);
+        free(r->lat);
+    }
+    // 接收者在最后一条消息之后还会空等 IDLE_MS，算吞吐时扣除
+    elapsed = now_ns() - start;
+    if (received < (long)nreceivers * total_msgs)
+        elapsed -= IDLE_MS * 1000000LL;
+    if (elapsed < send_ns)
+        elapsed = send_ns;
+
+    printf("%-4s send %8.0f msg/s  deliver %10.0f msg/s  got %ld/%ld  enobufs %ld  "
+           "avg %6.1fus  p50 %5ldus  p99 %5ldus  max %7.1fus\n",
+           name, total_msgs / (send_ns / 1e9), received / (elapsed / 1e9),
+           received, (long)nreceivers * total_msgs, dropped,
+           received ? lat_sum / 1e3 / received : 0.0,
+           percentile(lat, received, 0.50), percentile(lat, received, 0.99), lat_max / 1e3);
+
+    close(sender);
+    free(receivers);
+    free(lat);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int nreceivers = argc > 1 ? atoi(argv[1]) : 16;
+    int room = argc > 3 ? atoi(argv[3]) : 0;
+    int group_id;
+
+    total_msgs = argc > 2 ? atoi(argv[2]) : 100000;
+    if (nreceivers <= 0 || total_msgs <= 0 || room < 0 || room >= CHAT_MAX_ROOMS) {
+        printf("usage: %s [receivers] [messages] [room]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (resolve_family(room, &group_id) < 0) {
+        printf("generic netlink family \"%s\" not found, is the module loaded?\n", CHAT_NL_FAMILY);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d receivers, %d broadcasts in room %d\n", nreceivers, total_msgs, room);
+    if (run("dev", 0, nreceivers, room, group_id) < 0 || run("nl", 1, nreceivers, room, group_id) < 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
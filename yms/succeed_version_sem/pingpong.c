@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "chat_device.h"
+
+// 单条消息的投递延迟：父子两个进程各开一个会话，用私聊消息来回传递，
+// 往返时间的一半即单向投递延迟。两个进程分别绑定到指定的核上
+// 用法：./pingpong [往返次数] [忙轮询上限 us，0 为关闭] [父进程 cpu] [子进程 cpu]
+
+#define DEVICE_PATH "/dev/chat_device"
+#define MAX_MSG_LEN 256
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("sched_setaffinity");
+}
+
+static int open_session(int busy_us)
+{
+    int fd = open(DEVICE_PATH, O_RDWR);
+    char buf[MAX_MSG_LEN];
+
+    if (fd < 0)
+    {
+        perror("Failed to open device");
+        exit(1);
+    }
+    if (busy_us && ioctl(fd, CHAT_SET_BUSY_POLL, busy_us) < 0)
+    {
+        perror("CHAT_SET_BUSY_POLL");
+        exit(1);
+    }
+    // 跳过设备中已有的消息，只从当前位置开始收
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    fcntl(fd, F_SETFL, 0);
+    return fd;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+    int busy_us = argc > 2 ? atoi(argv[2]) : 0;
+    int cpu_parent = argc > 3 ? atoi(argv[3]) : -1;
+    int cpu_child = argc > 4 ? atoi(argv[4]) : -1;
+    int ready[2];
+    char msg[64], buf[MAX_MSG_LEN];
+    long long *rtt;
+    long long start;
+    pid_t child;
+    int fd, len, i;
+
+    if (rounds <= 0 || busy_us < 0 || busy_us > CHAT_BUSY_POLL_MAX_US)
+    {
+        printf("usage: %s [rounds] [busy poll us, 0-%d] [parent cpu] [child cpu]\n", argv[0], CHAT_BUSY_POLL_MAX_US);
+        return 1;
+    }
+
+    // 子进程打开会话后才能开始，否则第一条消息会在它打开之前发出
+    if (pipe(ready) < 0)
+        return 1;
+
+    child = fork();
+    if (child == 0)
+    {
+        pin(cpu_child);
+        fd = open_session(busy_us);
+        write(ready[1], "", 1);
+        len = snprintf(msg, sizeof(msg), "@%d pong", getppid());
+        for (i = 0; i < rounds; i++)
+        {
+            if (read(fd, buf, sizeof(buf)) < 0 || write(fd, msg, len) < 0)
+            {
+                perror("child");
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    pin(cpu_parent);
+    fd = open_session(busy_us);
+    read(ready[0], buf, 1);
+    rtt = calloc(rounds, sizeof(long long));
+    len = snprintf(msg, sizeof(msg), "@%d ping", child);
+
+    for (i = 0; i < rounds; i++)
+    {
+        start = now_ns();
+        if (write(fd, msg, len) < 0 || read(fd, buf, sizeof(buf)) < 0)
+        {
+            perror("parent");
+            kill(child, SIGKILL);
+            return 1;
+        }
+        rtt[i] = now_ns() - start;
+    }
+    waitpid(child, NULL, 0);
+
+    qsort(rtt, rounds, sizeof(long long), cmp_ll);
+    printf("%d round trips, busy poll %d us\n", rounds, busy_us);
+    printf("one-way p50: %8.2f us\n", rtt[rounds / 2] / 2000.0);
+    printf("one-way p99: %8.2f us\n", rtt[(long)rounds * 99 / 100] / 2000.0);
+    printf("one-way max: %8.2f us\n", rtt[rounds - 1] / 2000.0);
+
+    free(rtt);
+    close(fd);
+    return 0;
+}